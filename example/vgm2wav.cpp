@@ -1,22 +1,16 @@
-#ifdef _WIN32
-#include <io.h>
-#else
-#include <unistd.h>
-#define _open open
-#define _write write
-#define _lseek lseek
-#define _close close
-#endif
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 #include "../sccvgm.hpp"
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
-
 typedef struct {
     char riff[4];
     unsigned int fsize;
@@ -33,56 +27,71 @@ typedef struct {
     unsigned int dsize;
 } WavHeader;
 
-int main(int argc, char* argv[])
+typedef struct {
+    std::string input;
+    std::string output;
+    uintmax_t size;
+} Job;
+
+typedef struct {
+    uint32_t samples; // rendered samples
+    double seconds;   // elapsed time
+} Result;
+
+static double now()
 {
-    if (argc < 3) {
-        puts("usage: vgm2wav /path/to/input/file.vgm /path/to/output/file.wav");
-        return -1;
-    }
+    using namespace std::chrono;
+    return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+}
 
-    // Read VGM file to the memory
-    FILE* fp = fopen(argv[1], "rb");
+// Read VGM file to the memory
+static bool readFile(const char* path, std::vector<uint8_t>& vgm)
+{
+    FILE* fp = fopen(path, "rb");
     if (!fp) {
-        puts("VGM file not found.");
-        return -1;
+        printf("%s: VGM file not found.\n", path);
+        return false;
     }
     fseek(fp, 0, SEEK_END);
     long size = ftell(fp);
     if (size < 1) {
-        puts("VGM file is empty.");
+        printf("%s: VGM file is empty.\n", path);
         fclose(fp);
-        return -1;
+        return false;
     }
     fseek(fp, 0, SEEK_SET);
-    uint8_t* vgm = (uint8_t*)malloc(size);
-    if (!vgm) {
-        puts("No memory.");
+    vgm.resize(size);
+    if (size != (long)fread(vgm.data(), 1, size, fp)) {
+        printf("%s: File read error\n", path);
         fclose(fp);
-        return -1;
-    }
-    if (size != fread(vgm, 1, size, fp)) {
-        puts("File read error");
-        free(vgm);
-        fclose(fp);
-        return -1;
+        return false;
     }
     fclose(fp);
+    return true;
+}
+
+// Convert a VGM file to a wav file with the driver (the driver can be reused for the next file)
+static bool convert(scc::VgmDriver& scc, const char* input, const char* output, bool verbose, Result* result)
+{
+    double start = now();
+    std::vector<uint8_t> vgm;
+    if (!readFile(input, vgm)) {
+        return false;
+    }
 
     // Load to the driver
-    scc::VgmDriver scc;
-    if (!scc.load(vgm, size)) {
-        puts("scc.load failed! (invalid data, version or chipset)");
-        free(vgm);
-        return -1;
+    if (!scc.load(vgm.data(), vgm.size())) {
+        printf("%s: scc.load failed! (invalid data, version or chipset)\n", input);
+        return false;
     }
 
-    // Open wav file
-    fp = fopen(argv[2], "wb");
+    // Open wav file (written through a large buffer, and the header is updated at the end)
+    FILE* fp = fopen(output, "wb");
     if (!fp) {
-        puts("Can not open wav file.");
-        free(vgm);
-        return -1;
+        printf("%s: Can not open wav file.\n", output);
+        return false;
     }
+    setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
 
     // initialize wave header
     WavHeader wh;
@@ -94,45 +103,179 @@ int main(int argc, char* argv[])
     wh.bnum = 16;
     wh.fid = 1;
     wh.ch = 1;
-    wh.sample = 44100;
-    wh.bps = 88200;
+    wh.sample = scc.getRate();
+    wh.bps = scc.getRate() * 2;
     wh.bsize = 2;
     wh.bits = 16;
     wh.dsize = 0;
     fwrite(&wh, 1, sizeof(wh), fp);
 
-    puts("Song info:");
-    printf("- Loop Cycle: %u (%u sec)\n", scc.getLoopCycle(), scc.getLoopCycle() / 44100);
-    printf("- Total Cycle: %u (%u sec)\n", scc.getLengthCycle(), scc.getLengthCycle() / 44100);
-
-    // render pcm
-    int16_t buf[4410];
-    while (scc.getLoopCount() < 1 && scc.isPlaying()) {
-        scc.render(buf, (int)sizeof(buf) / 2);
-        fwrite(buf, 1, sizeof(buf), fp);
-        wh.dsize += (int)sizeof(buf);
-    }
-
-    // render fadeout in 3.2 sec
-    for (int i = 0; i < 32; i++) {
-        scc.render(buf, (int)sizeof(buf) / 2);
-        for (int n = 0; n < (int)(sizeof(buf) / 2); n++) {
-            int wav = buf[n];
-            wav *= 32 - i;
-            wav /= 32;
-            buf[n] = (int16_t)wav;
+    if (verbose) {
+        puts("Song info:");
+        printf("- Loop Cycle: %u (%u sec)\n", scc.getLoopCycle(), scc.getLoopCycle() / 44100);
+        printf("- Total Cycle: %u (%u sec)\n", scc.getLengthCycle(), scc.getLengthCycle() / 44100);
+    }
+
+    // render pcm (in 0.1 sec) until the end of the fadeout in 3.2 sec from the loop point
+    std::vector<int16_t> buf(scc.getRate() / 10);
+    const int size = (int)buf.size() * 2;
+    const int fade = scc.getRate() * 32 / 10;
+    scc.setFadeOut(1, fade);
+    while (scc.isPlaying()) {
+        scc.render(buf.data(), (int)buf.size());
+        fwrite(buf.data(), 1, size, fp);
+        wh.dsize += size;
+    }
+
+    // render fadeout in 3.2 sec after the end of the song without the loop
+    if (!scc.isFading()) {
+        scc.setGain(0, fade);
+        for (int i = 0; i < 32; i++) {
+            scc.render(buf.data(), (int)buf.size());
+            fwrite(buf.data(), 1, size, fp);
+            wh.dsize += size;
         }
-        fwrite(buf, 1, sizeof(buf), fp);
-        wh.dsize += (int)sizeof(buf);
     }
 
     // update wave header
     wh.fsize = wh.dsize + sizeof(wh) - 8;
-    int fd = _open(argv[2], O_RDWR | O_BINARY);
-    if (-1 != fd) {
-        _lseek(fd, 0, 0);
-        _write(fd, &wh, sizeof(wh));
-        _close(fd);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&wh, 1, sizeof(wh), fp);
+    if (0 != fclose(fp)) {
+        printf("%s: File write error\n", output);
+        return false;
+    }
+    result->samples = wh.dsize / 2;
+    result->seconds = now() - start;
+    return true;
+}
+
+// Collect the VGM files from the arguments (a directory is expanded to the *.vgm files in it)
+static bool collectJobs(int argc, char* argv[], const char* outputDirectory, std::vector<Job>& jobs)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    for (int i = 0; i < argc; i++) {
+        std::vector<fs::path> inputs;
+        fs::path base;
+        if (fs::is_directory(argv[i], ec)) {
+            base = argv[i];
+            for (const auto& entry : fs::recursive_directory_iterator(argv[i], ec)) {
+                std::string ext = entry.path().extension().string();
+                std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+                if (entry.is_regular_file(ec) && ext == ".vgm") {
+                    inputs.push_back(entry.path());
+                }
+            }
+        } else {
+            inputs.push_back(argv[i]);
+        }
+        for (const auto& input : inputs) {
+            Job job;
+            job.input = input.string();
+            fs::path output = input;
+            output.replace_extension(".wav");
+            if (outputDirectory) {
+                // keeps the layout of the sub directories of the input directory
+                output = fs::path(outputDirectory) / (base.empty() ? output.filename() : output.lexically_relative(base));
+                fs::create_directories(output.parent_path(), ec);
+            }
+            job.output = output.string();
+            job.size = fs::file_size(input, ec);
+            if (ec) {
+                printf("%s: VGM file not found.\n", job.input.c_str());
+                return false;
+            }
+            jobs.push_back(job);
+        }
+    }
+    return true;
+}
+
+// Convert the files on a pool of workers that have their own driver instance
+static int batch(int argc, char* argv[])
+{
+    int threads = (int)std::thread::hardware_concurrency();
+    const char* outputDirectory = NULL;
+    int rate = 44100;
+    int i = 0;
+    for (; i < argc && '-' == argv[i][0]; i++) {
+        if (0 == strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-o") && i + 1 < argc) {
+            outputDirectory = argv[++i];
+        } else if (0 == strcmp(argv[i], "-r") && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (rate < 8000 || 192000 < rate) {
+        puts("Unsupported sampling rate (8000 to 192000).");
+        return -1;
+    }
+    std::vector<Job> jobs;
+    if (!collectJobs(argc - i, argv + i, outputDirectory, jobs)) {
+        return -1;
+    }
+    if (jobs.empty()) {
+        puts("No VGM files.");
+        return -1;
+    }
+    threads = std::max(1, std::min(threads, (int)jobs.size()));
+
+    // the larger files first, so that a long song does not start at the end
+    std::stable_sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) { return a.size > b.size; });
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(0);
+    std::atomic<uint64_t> samples(0);
+    std::mutex printMutex;
+    double start = now();
+    auto worker = [&]() {
+        scc::VgmDriver scc(rate);
+        for (size_t index = next++; index < jobs.size(); index = next++) {
+            Result result;
+            bool succeeded = convert(scc, jobs[index].input.c_str(), jobs[index].output.c_str(), false, &result);
+            std::lock_guard<std::mutex> lock(printMutex);
+            if (succeeded) {
+                samples += result.samples;
+                printf("%s: %.1f sec in %.3f sec (x%.1f realtime)\n", jobs[index].output.c_str(), result.samples / (double)rate, result.seconds, result.samples / (double)rate / result.seconds);
+            } else {
+                failed++;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int n = 1; n < threads; n++) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    double elapsed = now() - start;
+    printf("Total: %d files, %.1f sec in %.3f sec with %d threads (x%.1f realtime)\n", (int)jobs.size() - failed, samples / (double)rate, elapsed, threads, samples / (double)rate / elapsed);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (2 < argc && 0 == strcmp(argv[1], "--batch")) {
+        return batch(argc - 2, argv + 2);
+    }
+    if (argc < 3) {
+        puts("usage: vgm2wav /path/to/input/file.vgm /path/to/output/file.wav [sampling_rate]");
+        puts("       vgm2wav --batch [-j threads] [-o /path/to/output/directory] [-r sampling_rate] /path/to/input/file_or_directory ...");
+        return -1;
+    }
+    int rate = 3 < argc ? atoi(argv[3]) : 44100;
+    if (rate < 8000 || 192000 < rate) {
+        puts("Unsupported sampling rate (8000 to 192000).");
+        return -1;
     }
-    return 0;
+    scc::VgmDriver scc(rate);
+    Result result;
+    return convert(scc, argv[1], argv[2], true, &result) ? 0 : -1;
 }
@@ -0,0 +1,1030 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../sccvgm.hpp"
+
+static double now()
+{
+    using namespace std::chrono;
+    return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool readFile(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size < 1) {
+        fclose(fp);
+        return false;
+    }
+    data.resize(size);
+    bool result = (size_t)size == fread(data.data(), 1, size, fp);
+    fclose(fp);
+    return result;
+}
+
+// The per-sample path of the original VgmDriver::render: execute the commands when the wait expires, and calc both chips for each sample
+class ReferenceDriver
+{
+  private:
+    scc::EMU2149 psg;
+    scc::EMU2212 scc;
+    const uint8_t* data;
+    size_t size;
+    size_t cursor;
+    size_t loopOffset;
+    uint32_t clockPSG;
+    uint32_t clockSCC;
+    int wait;
+    bool end;
+
+    void execute()
+    {
+        while (!end && wait < 1) {
+            if (size <= cursor) {
+                end = true;
+                break;
+            }
+            uint8_t cmd = data[cursor++];
+            if (0x31 == cmd) {
+                cursor++;
+            } else if (0xA0 == cmd) {
+                psg.writeReg(data[cursor], data[cursor + 1]);
+                cursor += 2;
+            } else if (0xD2 == cmd) {
+                uint8_t offset = data[cursor + 1];
+                uint8_t value = data[cursor + 2];
+                switch (data[cursor] & 0x7F) {
+                    case 0x00: scc.write_waveform1(offset, value); break;
+                    case 0x01: scc.write_frequency(offset, value); break;
+                    case 0x02: scc.write_volume(offset, value); break;
+                    case 0x03: scc.write_keyoff(value); break;
+                    case 0x04: scc.write_waveform2(offset, value); break;
+                    case 0x05: scc.write_test(value); break;
+                }
+                cursor += 3;
+            } else if (0x61 == cmd) {
+                wait += data[cursor] | (data[cursor + 1] << 8);
+                cursor += 2;
+            } else if (0x62 == cmd) {
+                wait += 735;
+            } else if (0x63 == cmd) {
+                wait += 882;
+            } else if (0x70 <= cmd && cmd <= 0x7F) {
+                wait += cmd - 0x6F;
+            } else if (0x66 == cmd && loopOffset) {
+                cursor = loopOffset;
+                break; // the commands at the loop point are executed at the next sample
+            } else if (0x66 == cmd || (0xDD != cmd && 0xDE != cmd && 0xDF != cmd && cmd < 0xFD)) {
+                end = true;
+            }
+        }
+    }
+
+  public:
+    ReferenceDriver() : psg(3579545, 44100), scc(3579545, 44100) {}
+
+    void load(const std::vector<uint8_t>& vgm)
+    {
+        data = vgm.data();
+        size = vgm.size();
+        uint32_t head, loop;
+        memcpy(&head, &data[0x34], 4);
+        memcpy(&loop, &data[0x1C], 4);
+        memcpy(&clockPSG, &data[0x74], 4);
+        memcpy(&clockSCC, &data[0x9C], 4);
+        cursor = head + 0x40 - 0x0C;
+        loopOffset = loop ? loop + 0x1C : 0;
+        wait = 0;
+        end = false;
+        psg.reset();
+        psg.setEngine(scc::EMU2149::Engine::Tick);
+        psg.setVolumeMode(2);
+        psg.setClockDivider(1);
+        scc.reset();
+        scc.setEngine(scc::EMU2212::Engine::Scalar);
+        scc.set_type(scc::EMU2212::Type::Standard);
+    }
+
+    void render(int16_t* buf, int samples)
+    {
+        for (int i = 0; i < samples; i++) {
+            execute();
+            wait--;
+            int w = 0;
+            if (clockPSG) {
+                w += psg.calc();
+            }
+            if (clockSCC) {
+                w += scc.calc();
+            }
+            w = w * 600 / 100;
+            buf[i] = (int16_t)(w < -31129 ? -31129 : (31128 < w ? 31128 : w));
+        }
+    }
+};
+
+static void benchRender(const std::vector<uint8_t>& vgm, int seconds)
+{
+    static const int callbackSizes[] = {1, 16, 64, 256, 1024, 4410};
+    const int total = seconds * 44100;
+    std::vector<int16_t> buf(4410);
+    std::vector<int16_t> expected(total + 4410);
+    std::vector<int16_t> actual(total + 4410);
+    puts("Render throughput:");
+    {
+        ReferenceDriver reference;
+        reference.load(vgm);
+        double start = now();
+        for (int rendered = 0; rendered < total; rendered += 64) {
+            reference.render(&expected[rendered], 64);
+        }
+        double elapsed = now() - start;
+        printf("- per-sample reference: %10.0f samples/sec (x%.1f realtime)\n", total / elapsed, total / elapsed / 44100);
+    }
+    for (int size : callbackSizes) {
+        scc::VgmDriver scc;
+        scc.load(vgm.data(), vgm.size());
+        double start = now();
+        for (int rendered = 0; rendered < total; rendered += size) {
+            scc.render(&actual[rendered], size);
+        }
+        double elapsed = now() - start;
+        bool identical = 0 == memcmp(expected.data(), actual.data(), total * 2);
+        printf("- callback %4d samples: %10.0f samples/sec (x%.1f realtime, %s)\n", size, total / elapsed, total / elapsed / 44100, identical ? "identical" : "DIFFERENT");
+    }
+}
+
+template <typename Driver>
+static void benchDriver(const std::vector<uint8_t>& vgm, int seconds, const char* name)
+{
+    const int total = seconds * 44100;
+    std::vector<int16_t> buf(64);
+    Driver scc;
+    if (!scc.load(vgm.data(), vgm.size())) {
+        printf("- %-14s: not supported\n", name);
+        return;
+    }
+    double start = now();
+    for (int rendered = 0; rendered < total; rendered += 64) {
+        scc.render(buf.data(), 64);
+    }
+    double elapsed = now() - start;
+    printf("- %-14s: %10.0f samples/sec (x%.1f realtime)\n", name, total / elapsed, total / elapsed / 44100);
+}
+
+template <typename T>
+static void benchStereo(const std::vector<uint8_t>& vgm, int seconds, const char* name, bool panned)
+{
+    const int total = seconds * 44100;
+    std::vector<T> buf(1024 * 2);
+    scc::VgmDriver scc;
+    scc.load(vgm.data(), vgm.size());
+    if (panned) {
+        for (int ch = 0; ch < 3; ch++) {
+            scc.setPanPSG(ch, 256 - ch * 128, ch * 128);
+        }
+        for (int ch = 0; ch < 5; ch++) {
+            scc.setPanSCC(ch, 256 - ch * 64, ch * 64);
+        }
+    }
+    double start = now();
+    for (int rendered = 0; rendered < total; rendered += 1024) {
+        scc.renderStereo(buf.data(), 1024);
+    }
+    double elapsed = now() - start;
+    printf("- %-14s: %10.0f samples/sec (x%.1f realtime)\n", name, total / elapsed, total / elapsed / 44100);
+}
+
+// Stems of the 8 channels in a single pass vs the mono render
+static void benchStems(const std::vector<uint8_t>& vgm, int seconds)
+{
+    const int total = seconds * 44100;
+    std::vector<int16_t> stems(1024 * 8);
+    int16_t* ptr[8];
+    for (int i = 0; i < 8; i++) {
+        ptr[i] = &stems[i * 1024];
+    }
+    scc::VgmDriver scc;
+    scc.load(vgm.data(), vgm.size());
+    double start = now();
+    for (int rendered = 0; rendered < total; rendered += 1024) {
+        scc.renderStems(ptr, NULL, 1024);
+    }
+    double single = now() - start;
+    scc::VgmDriver mono;
+    mono.load(vgm.data(), vgm.size());
+    start = now();
+    for (int rendered = 0; rendered < total; rendered += 1024) {
+        mono.render(ptr[0], 1024);
+    }
+    double mixed = now() - start;
+    printf("Stems (8 channels):\n");
+    printf("- mono render   : %10.0f samples/sec (x%.1f realtime)\n", total / mixed, total / mixed / 44100);
+    printf("- 8 stems       : %10.0f samples/sec (x%.1f realtime)\n", total / single, total / single / 44100);
+}
+
+static void benchEnginePSG(scc::EMU2149::Engine engine, const char* name, int seconds, scc::Decimator::Quality quality = scc::Decimator::Quality::Medium)
+{
+    scc::EMU2149 psg(3579545, 44100);
+    psg.setClockDivider(1);
+    psg.reset();
+    psg.setFirQuality(quality);
+    psg.setEngine(engine);
+    // two tones (A and B), a noise (C) and an envelope
+    static const uint8_t regs[][2] = {{0, 0xFE}, {1, 0x00}, {2, 0x52}, {3, 0x02}, {6, 0x10}, {7, 0x1C}, {8, 15}, {9, 0x10}, {10, 12}, {11, 0x00}, {12, 0x10}, {13, 0x0E}};
+    for (auto& reg : regs) {
+        psg.writeReg(reg[0], reg[1]);
+    }
+    int16_t buf[256];
+    const int total = seconds * 44100;
+    double start = now();
+    for (int rendered = 0; rendered < total; rendered += 256) {
+        psg.calcBlock(buf, 256);
+    }
+    double elapsed = now() - start;
+    printf("- %-8s: %10.0f samples/sec (x%.1f realtime)\n", name, total / elapsed, total / elapsed / 44100);
+}
+
+static void benchEngineSCC(scc::EMU2212::Engine engine, const char* name, int seconds, scc::Decimator::Quality quality = scc::Decimator::Quality::Medium)
+{
+    scc::EMU2212 scc(3579545, 44100);
+    scc.reset();
+    scc.set_type(scc::EMU2212::Type::Standard);
+    scc.setFirQuality(quality);
+    scc.setEngine(engine);
+    if (scc.getEngine() != engine) {
+        printf("- %-8s: not supported\n", name);
+        return;
+    }
+    for (int ch = 0; ch < 5; ch++) {
+        for (int i = 0; i < 32; i++) {
+            scc.writeReg(ch * 32 + i, (uint32_t)(i * 8 - 128 + ch * 3));
+        }
+        scc.writeReg(0xC0 + ch * 2, 0x40 + ch * 0x35);
+        scc.writeReg(0xC1 + ch * 2, ch & 1);
+        scc.writeReg(0xD0 + ch, 15);
+    }
+    scc.writeReg(0xE1, 0x1F);
+    int16_t buf[256];
+    const int total = seconds * 44100;
+    double start = now();
+    for (int rendered = 0; rendered < total; rendered += 256) {
+        scc.calcBlock(buf, 256);
+    }
+    double elapsed = now() - start;
+    printf("- %-8s: %10.0f samples/sec (x%.1f realtime)\n", name, total / elapsed, total / elapsed / 44100);
+}
+
+// THD+N of a sine waveform: the energy that is not the fundamental (nor DC), relative to the fundamental
+static double toneDistortion(scc::EMU2212::Engine engine, uint32_t freq, scc::Decimator::Quality quality)
+{
+    const int rate = 44100;
+    scc::EMU2212 scc(3579545, rate);
+    scc.reset();
+    scc.set_type(scc::EMU2212::Type::Standard);
+    scc.setFirQuality(quality);
+    scc.setEngine(engine);
+    for (int i = 0; i < 32; i++) {
+        scc.writeReg(i, (uint32_t)(int)lround(sin(i * 2 * M_PI / 32) * 127));
+    }
+    scc.writeReg(0xC0, freq & 0xFF);
+    scc.writeReg(0xC1, freq >> 8);
+    scc.writeReg(0xD0, 15);
+    scc.writeReg(0xE1, 0x01);
+    std::vector<int16_t> buf(rate);
+    scc.calcBlock(buf.data(), 4410); // skip the key-on transient
+    scc.calcBlock(buf.data(), rate);
+    // the actual pitch is defined by the truncated phase increment and tick steps of the emulator
+    double ticksPerSample = (double)((1u << 31) / rate) / ((1u << 31) / (3579545 / 2));
+    double f0 = (double)((2 << 22) / (freq + 1)) * ticksPerSample * rate / (1 << 27);
+    double ss = 0, sc = 0, s1 = 0, cc = 0, sn = 0, c1 = 0, y1 = 0, ys = 0, yc = 0, yy = 0;
+    for (int n = 0; n < rate; n++) {
+        double sv = sin(2 * M_PI * f0 * n / rate), cv = cos(2 * M_PI * f0 * n / rate), y = buf[n];
+        ss += sv * sv, sc += sv * cv, s1 += sv, cc += cv * cv, c1 += cv, sn += 1;
+        ys += y * sv, yc += y * cv, y1 += y, yy += y * y;
+    }
+    // least squares fit of a*sin + b*cos + c
+    double m[3][4] = {{ss, sc, s1, ys}, {sc, cc, c1, yc}, {s1, c1, sn, y1}};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (i != j) {
+                double r = m[j][i] / m[i][i];
+                for (int k = 0; k < 4; k++) m[j][k] -= r * m[i][k];
+            }
+        }
+    }
+    double a = m[0][3] / m[0][0], b = m[1][3] / m[1][1], c = m[2][3] / m[2][2];
+    double fundamental = 0, residual = 0;
+    for (int n = 0; n < rate; n++) {
+        double fit = a * sin(2 * M_PI * f0 * n / rate) + b * cos(2 * M_PI * f0 * n / rate);
+        fundamental += fit * fit;
+        residual += (buf[n] - fit - c) * (buf[n] - fit - c);
+    }
+    return 10 * log10(residual / fundamental);
+}
+
+static void compareEngineSCC(const std::vector<uint8_t>& vgm, scc::EMU2212::Engine engine, const char* name, int seconds, scc::Decimator::Quality quality = scc::Decimator::Quality::Medium)
+{
+    const int total = seconds * 44100;
+    std::vector<int16_t> ref(total), out(total);
+    scc::VgmDriver a, b;
+    a.load(vgm.data(), vgm.size());
+    b.load(vgm.data(), vgm.size());
+    a.setEngineSCC(scc::EMU2212::Engine::Scalar);
+    b.setEngineSCC(engine);
+    if (scc::EMU2212::Engine::Fir == engine) {
+        b.setDecimator(quality);
+        b.setEnginePSG(scc::EMU2149::Engine::Event);
+    }
+    a.render(ref.data(), total);
+    b.render(out.data(), total);
+    // the latency of the engine (e.g., the linear phase FIR of Fir) is aligned to the least difference
+    double signal = 0, noise = INFINITY;
+    int peak = 0, latency = 0;
+    for (int lag = 0; lag <= 32 && noise; lag++) {
+        double s = 0, e = 0;
+        int p = 0;
+        for (int i = 0; i < total - lag; i++) {
+            int d = abs(ref[i] - out[i + lag]);
+            s += (double)ref[i] * ref[i];
+            e += (double)d * d;
+            p = d < p ? p : d;
+        }
+        if (e / s < noise / signal) {
+            signal = s, noise = e, peak = p, latency = lag;
+        }
+    }
+    printf("- %-8s: difference from Scalar %6.1f dB (peak %d, latency %d)", name, noise ? 10 * log10(noise / signal) : -INFINITY, peak, latency);
+    printf(", THD+N of a sine at");
+    static const uint32_t freqs[] = {0x1BF, 0x06F, 0x01B, 0x00D};
+    for (uint32_t freq : freqs) {
+        printf(" %.0fHz: %.1f dB", 3579545.0 / 32 / (freq + 1), toneDistortion(engine, freq, quality));
+    }
+    putchar('\n');
+}
+
+static void benchParallel(const std::vector<uint8_t>& vgm, int seconds)
+{
+    const int total = seconds * 44100;
+    std::vector<int16_t> ref(total), buf(total);
+    scc::VgmDriver sequential;
+    sequential.load(vgm.data(), vgm.size());
+    double start = now();
+    sequential.render(ref.data(), total);
+    double base = now() - start;
+    int cores = (int)std::thread::hardware_concurrency();
+    printf("Parallel render (%d cores):\n", cores);
+    for (int threads = 1; threads <= cores * 2; threads *= 2) {
+        scc::VgmDriver scc;
+        scc.load(vgm.data(), vgm.size());
+        start = now();
+        scc.renderParallel(buf.data(), total, threads);
+        double elapsed = now() - start;
+        printf("- %2d threads: %10.0f samples/sec (x%.2f of render)%s\n", threads, total / elapsed, base / elapsed, ref == buf ? "" : " MISMATCH");
+    }
+}
+
+static void benchConcurrentChips(const std::vector<uint8_t>& vgm, int seconds)
+{
+    static const int callbackSizes[] = {64, 256, 1024, 4410};
+    const int total = seconds * 44100;
+    std::vector<int16_t> ref(4410), buf(4410);
+    puts("Concurrent chips:");
+    for (int size : callbackSizes) {
+        scc::VgmDriver sequential, concurrent;
+        sequential.load(vgm.data(), vgm.size());
+        concurrent.load(vgm.data(), vgm.size());
+        concurrent.setConcurrentChips(true);
+        double base = 0, elapsed = 0;
+        bool match = true;
+        for (int rendered = 0; rendered < total; rendered += size) {
+            double start = now();
+            sequential.render(ref.data(), size);
+            double middle = now();
+            concurrent.render(buf.data(), size);
+            base += middle - start;
+            elapsed += now() - middle;
+            match = match && 0 == memcmp(ref.data(), buf.data(), size * 2);
+        }
+        printf("- callback %4d samples: %10.0f samples/sec (x%.2f of render)%s\n", size, total / elapsed, base / elapsed, match ? "" : " MISMATCH");
+    }
+}
+
+// Simulate an audio device: the callback reads 256 samples every 5.8 msec in real time
+static void benchStreaming(const std::vector<uint8_t>& vgm, int seconds, int lead)
+{
+    using namespace std::chrono;
+    const int callbackSize = 256;
+    const int callbacks = (seconds < 5 ? seconds : 5) * 44100 / callbackSize;
+    std::vector<int16_t> ref(callbacks * callbackSize), out(callbacks * callbackSize);
+    scc::VgmDriver reference, scc;
+    reference.load(vgm.data(), vgm.size());
+    reference.render(ref.data(), (int)ref.size());
+    scc.load(vgm.data(), vgm.size());
+    scc::VgmPlayer player(&scc, lead);
+    if (!player.start()) {
+        puts("- out of memory");
+        return;
+    }
+    while (player.getStatus().buffered < lead - callbackSize) {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    double worst = 0;
+    auto deadline = steady_clock::now();
+    for (int i = 0; i < callbacks; i++) {
+        deadline += microseconds(callbackSize * 1000000 / 44100);
+        std::this_thread::sleep_until(deadline);
+        double start = now();
+        player.read(&out[i * callbackSize], callbackSize);
+        double elapsed = now() - start;
+        worst = worst < elapsed ? elapsed : worst;
+    }
+    player.stop();
+    scc::VgmPlayer::Status status = player.getStatus();
+    printf("- lead %5d samples: underruns %u, oversized reads %u, min buffered %5d samples (%.1f msec), worst callback %.1f usec%s\n", lead, status.underruns, status.oversizedReads, status.minBuffered, status.minBuffered * 1000.0 / 44100, worst * 1000000, ref == out ? "" : " MISMATCH");
+}
+
+static void benchSeek(const std::vector<uint8_t>& vgm, scc::VgmDriver::SeekMode mode, uint32_t keyframeInterval)
+{
+    const int repeat = 20;
+    scc::VgmDriver scc;
+    scc.load(vgm.data(), vgm.size());
+    scc.setSeekMode(mode);
+    scc.setKeyframeInterval(keyframeInterval);
+    const char* modeName = scc::VgmDriver::SeekMode::Shadow == mode ? "shadow" : "emulation";
+    if (keyframeInterval) {
+        printf("Seek latency (%s, keyframe every %u cycles):\n", modeName, keyframeInterval);
+    } else if (scc::VgmDriver::SeekMode::Shadow == mode) {
+        printf("Seek latency (%s, default keyframes):\n", modeName);
+    } else {
+        printf("Seek latency (%s, no keyframes):\n", modeName);
+    }
+    for (int percent = 0; percent <= 100; percent += 10) {
+        uint32_t cycle = (uint32_t)((uint64_t)scc.getLengthCycle() * percent / 100);
+        double start = now();
+        for (int i = 0; i < repeat; i++) {
+            scc.seek(cycle);
+        }
+        double elapsed = now() - start;
+        printf("- %3d%% (%7u cycles): %8.1f usec\n", percent, cycle, elapsed * 1000000 / repeat);
+    }
+}
+
+// Save and restore the state at a frame (735 samples) as the rewind of a game does
+static void benchState(const std::vector<uint8_t>& vgm)
+{
+    const int repeat = 100000;
+    scc::VgmDriver scc;
+    scc.load(vgm.data(), vgm.size());
+    int16_t buf[735];
+    scc.render(buf, 735);
+    scc::VgmDriver::State state;
+    double start = now();
+    for (int i = 0; i < repeat; i++) {
+        scc.saveState(&state);
+    }
+    double saved = now() - start;
+    start = now();
+    for (int i = 0; i < repeat; i++) {
+        scc.loadState(&state);
+    }
+    double loaded = now() - start;
+    printf("Save state (%d bytes):\n", (int)sizeof(state));
+    printf("- saveState: %8.3f usec\n", saved * 1000000 / repeat);
+    printf("- loadState: %8.3f usec\n", loaded * 1000000 / repeat);
+}
+
+// Start a driver for a listener from the song compiled once, vs compiling the VGM data for each driver
+static void benchSong(const std::vector<uint8_t>& vgm)
+{
+    const int repeat = 1000;
+    scc::VgmSong song;
+    song.load(vgm.data(), vgm.size());
+    double start = now();
+    for (int i = 0; i < repeat; i++) {
+        scc::VgmDriver scc;
+        scc.load(&song);
+    }
+    double shared = now() - start;
+    start = now();
+    for (int i = 0; i < repeat; i++) {
+        scc::VgmDriver scc;
+        scc.load(vgm.data(), vgm.size());
+    }
+    double compiled = now() - start;
+    puts("Driver start (construct and load):");
+    printf("- shared song  : %8.3f usec\n", shared * 1000000 / repeat);
+    printf("- compile data : %8.3f usec\n", compiled * 1000000 / repeat);
+}
+
+// Play the song with 2 sound effects (the song itself as the effects) on one chip pair, vs a driver for each stream
+static void benchSfx(const std::vector<uint8_t>& vgm, int seconds)
+{
+    const int total = seconds * 44100;
+    std::vector<int16_t> buf(256);
+    std::vector<int16_t> sum(256);
+    scc::VgmSong song;
+    song.load(vgm.data(), vgm.size());
+    scc::VgmDriver mixer;
+    mixer.load(&song);
+    mixer.playSfx(&song, 1);
+    mixer.playSfx(&song, 2);
+    double start = now();
+    for (int rendered = 0; rendered < total; rendered += 256) {
+        mixer.render(buf.data(), 256);
+    }
+    double mixed = now() - start;
+    scc::VgmDriver drivers[3];
+    for (auto& driver : drivers) {
+        driver.load(&song);
+    }
+    start = now();
+    for (int rendered = 0; rendered < total; rendered += 256) {
+        memset(sum.data(), 0, 256 * 2);
+        for (auto& driver : drivers) {
+            driver.render(buf.data(), 256);
+            for (int i = 0; i < 256; i++) {
+                sum[i] += buf[i];
+            }
+        }
+    }
+    double summed = now() - start;
+    puts("Song and 2 sound effects (callback 256 samples):");
+    printf("- playSfx (1 chip pair) : %10.0f samples/sec (x%.1f realtime)\n", total / mixed, total / mixed / 44100);
+    printf("- 3 drivers summed      : %10.0f samples/sec (x%.1f realtime)\n", total / summed, total / summed / 44100);
+}
+
+// Render a looping song with the loop cache (after the cache is filled), vs the emulation
+static void benchLoopCache(const std::vector<uint8_t>& vgm, int seconds, scc::VgmDriver::LoopCacheMode mode, const char* name)
+{
+    const int total = seconds * 44100;
+    std::vector<int16_t> buf(256);
+    scc::VgmDriver scc;
+    scc.load(vgm.data(), vgm.size());
+    if (!scc.setLoopCache(44100 * 600, mode)) {
+        puts("- out of memory");
+        return;
+    }
+    for (int i = 0; i < 4 && !scc.isLoopCached(); i++) {
+        // fill the cache in up to 4 loops
+        for (uint32_t loop = scc.getLoopCount(); loop == scc.getLoopCount() && scc.isPlaying();) {
+            scc.render(buf.data(), 256);
+        }
+    }
+    if (!scc.isLoopCached()) {
+        printf("- %s: not cached (no loop in the steady state)\n", name);
+        return;
+    }
+    double start = now();
+    for (int rendered = 0; rendered < total; rendered += 256) {
+        scc.render(buf.data(), 256);
+    }
+    double elapsed = now() - start;
+    printf("- %s: %10.0f samples/sec (x%.1f realtime)\n", name, total / elapsed, total / elapsed / 44100);
+}
+
+// Throughput of the cores while the channels are keyed on at volume 0 (the rests between the phrases)
+static void benchIdle(int seconds)
+{
+    const int total = seconds * 44100;
+    int16_t buf[256];
+    puts("Idle core throughput (volume 0):");
+    scc::EMU2149 psg(3579545, 44100);
+    psg.setClockDivider(1);
+    psg.reset();
+    static const uint8_t regs[][2] = {{0, 0xFE}, {1, 0x00}, {2, 0x52}, {3, 0x02}, {6, 0x10}, {7, 0x38}, {8, 0}, {9, 0}, {10, 0}};
+    for (auto& reg : regs) {
+        psg.writeReg(reg[0], reg[1]);
+    }
+    for (scc::EMU2149::Engine engine : {scc::EMU2149::Engine::Tick, scc::EMU2149::Engine::Event}) {
+        psg.setEngine(engine);
+        double start = now();
+        for (int rendered = 0; rendered < total; rendered += 256) {
+            psg.calcBlock(buf, 256);
+        }
+        double elapsed = now() - start;
+        printf("- PSG %-6s: %10.0f samples/sec (x%.1f realtime)\n", scc::EMU2149::Engine::Tick == engine ? "Tick" : "Event", total / elapsed, total / elapsed / 44100);
+    }
+    scc::EMU2212 scc(3579545, 44100);
+    scc.reset();
+    scc.set_type(scc::EMU2212::Type::Standard);
+    for (int ch = 0; ch < 5; ch++) {
+        for (int i = 0; i < 32; i++) {
+            scc.writeReg(ch * 32 + i, (uint32_t)(i * 8 - 128 + ch * 3));
+        }
+        scc.writeReg(0xC0 + ch * 2, 0x40 + ch * 0x35);
+        scc.writeReg(0xD0 + ch, 0);
+    }
+    scc.writeReg(0xE1, 0x1F);
+    for (scc::EMU2212::Engine engine : {scc::EMU2212::Engine::Scalar, scc::EMU2212::Engine::Simd}) {
+        scc.setEngine(engine);
+        double start = now();
+        for (int rendered = 0; rendered < total; rendered += 256) {
+            scc.calcBlock(buf, 256);
+        }
+        double elapsed = now() - start;
+        printf("- SCC %-6s: %10.0f samples/sec (x%.1f realtime)\n", scc::EMU2212::Engine::Scalar == engine ? "Scalar" : "Simd", total / elapsed, total / elapsed / 44100);
+    }
+}
+
+// Deterministic pseudo-random numbers of the checks (xorshift32)
+class Fuzz
+{
+  private:
+    uint32_t x;
+
+  public:
+    Fuzz(uint32_t seed) : x(seed * 2654435761u + 1) {}
+
+    uint32_t next()
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+
+    uint32_t below(uint32_t n) { return next() % n; }
+};
+
+// loadState of corrupted states: it rejects them, or the playback continues from the loaded state (run it by make check)
+static bool checkState(const std::vector<uint8_t>& vgm)
+{
+    const int bases = 16;
+    const int trials = 20000;
+    Fuzz fuzz(21);
+    scc::VgmDriver scc;
+    scc.load(vgm.data(), vgm.size());
+    std::vector<scc::VgmDriver::State> states(bases);
+    int16_t buf[512];
+    for (int i = 0; i < bases; i++) {
+        scc.setGain((int)fuzz.below(32769), (int)fuzz.below(44100));
+        scc.render(buf, 1 + (int)fuzz.below(256));
+        scc.saveState(&states[i]);
+        scc.setFadeOut(1 + (int)fuzz.below(2), 1 + (int)fuzz.below(44100));
+        scc.seek(fuzz.below(scc.getLengthCycle()));
+    }
+    // the cursor at the end of the events without the end flag (the next render would read past the events)
+    scc::VgmDriver::State end = states[0];
+    end.cursor = (int32_t)end.eventCount;
+    end.end = 0;
+    bool ok = !scc.loadState(&end);
+    int accepted = 0;
+    for (int i = 0; i < trials; i++) {
+        scc::VgmDriver::State state = states[i % bases];
+        uint8_t* bytes = (uint8_t*)&state;
+        if (fuzz.below(2)) {
+            // a field of 4 bytes
+            uint32_t value = fuzz.below(4) ? fuzz.next() : fuzz.next() >> fuzz.below(32);
+            memcpy(&bytes[fuzz.below(sizeof(state) / 4) * 4], &value, 4);
+        } else {
+            for (int n = 1 + (int)fuzz.below(3); n; n--) {
+                bytes[fuzz.below(sizeof(state))] = (uint8_t)fuzz.next();
+            }
+        }
+        scc.setEnginePSG(fuzz.below(2) ? scc::EMU2149::Engine::Event : scc::EMU2149::Engine::Blep);
+        scc.setEngineSCC(fuzz.below(2) ? scc::EMU2212::Engine::Simd : scc::EMU2212::Engine::Mipmap);
+        if (!scc.loadState(&state)) {
+            continue;
+        }
+        accepted++;
+        scc::VgmDriver::State saved;
+        scc.saveState(&saved);
+        ok = ok && 0 == memcmp(&saved, &state, sizeof(state));
+        if (fuzz.below(2)) {
+            scc.render(buf, 512);
+        } else {
+            scc.renderStereo(buf, 256);
+        }
+    }
+    printf("- loadState of %d corrupted states: %d accepted%s\n", trials, accepted, ok ? "" : " (saveState differs) FAILED");
+    return ok;
+}
+
+static const uint32_t checkRates[4] = {8000, 44100, 48000, 192000};
+
+// FNV-1a hash of the samples
+static uint64_t hashSamples(uint64_t hash, const int16_t* buf, int samples)
+{
+    const uint8_t* bytes = (const uint8_t*)buf;
+    for (int i = 0; i < samples * 2; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// A few random SCC register writes (biased to volume 0, so the chip is often idle)
+static void writeRandomSCC(Fuzz& fuzz, scc::EMU2212* scc)
+{
+    for (int n = (int)fuzz.below(4); n; n--) {
+        uint32_t kind = fuzz.below(16);
+        if (kind < 4) {
+            scc->writeReg(fuzz.below(160), fuzz.next());
+        } else if (kind < 9) {
+            scc->writeReg(0xC0 + fuzz.below(10), fuzz.next());
+        } else if (kind < 14) {
+            scc->writeReg(0xD0 + fuzz.below(5), fuzz.below(2) ? 0 : fuzz.next());
+        } else if (kind < 15) {
+            scc->writeReg(0xE1, fuzz.next());
+        } else {
+            scc->writeReg(0xE2, fuzz.next() & 0x23);
+        }
+    }
+}
+
+static void resetRandomSCC(Fuzz& fuzz, scc::EMU2212* scc, scc::EMU2212::Engine engine)
+{
+    scc->reset();
+    scc->set_type(scc::EMU2212::Type::Standard);
+    scc->setEngine(engine);
+    for (int i = 0; i < 160; i++) {
+        scc->writeReg(i, fuzz.next());
+    }
+}
+
+// Hash of the SCC output of a random register stream in blocks up to 10 msec
+static uint64_t fuzzSCC(scc::EMU2212::Engine engine, uint32_t rate, uint32_t seed)
+{
+    Fuzz fuzz(seed);
+    scc::EMU2212 scc(3579545, rate);
+    resetRandomSCC(fuzz, &scc, engine);
+    uint64_t hash = 0xCBF29CE484222325ull;
+    int16_t buf[1920]; // 10 msec at 192kHz
+    for (int round = 0; round < 100; round++) {
+        writeRandomSCC(fuzz, &scc);
+        int samples = 1 + (int)fuzz.below(rate / 100);
+        scc.calcBlock(buf, samples);
+        hash = hashSamples(hash, buf, samples);
+    }
+    return hash;
+}
+
+// A few random PSG register writes (biased to volume 0 and a fast noise)
+static void writeRandomPSG(Fuzz& fuzz, scc::EMU2149* psg)
+{
+    for (int n = (int)fuzz.below(4); n; n--) {
+        uint8_t reg = (uint8_t)fuzz.below(14);
+        uint8_t value = (uint8_t)fuzz.next();
+        if (8 <= reg && reg <= 10 && fuzz.below(2)) {
+            value = 0;
+        } else if (6 == reg) {
+            value &= fuzz.below(2) ? 0x01 : 0x1F;
+        }
+        psg->writeReg(reg, value);
+    }
+}
+
+static void resetRandomPSG(scc::EMU2149* psg, scc::EMU2149::Engine engine)
+{
+    psg->setClockDivider(1);
+    psg->reset();
+    psg->setEngine(engine);
+}
+
+// Hash of the PSG output of a random register stream in blocks up to 10 msec
+static uint64_t fuzzPSG(scc::EMU2149::Engine engine, uint32_t rate, uint32_t seed)
+{
+    Fuzz fuzz(seed);
+    scc::EMU2149 psg(3579545, rate);
+    resetRandomPSG(&psg, engine);
+    uint64_t hash = 0xCBF29CE484222325ull;
+    int16_t buf[1920];
+    for (int round = 0; round < 100; round++) {
+        writeRandomPSG(fuzz, &psg);
+        int samples = 1 + (int)fuzz.below(rate / 100);
+        psg.calcBlock(buf, samples);
+        hash = hashSamples(hash, buf, samples);
+    }
+    return hash;
+}
+
+// The Event core is bit-exact with the Tick core
+static bool checkEvent()
+{
+    bool ok = true;
+    for (uint32_t rate : checkRates) {
+        for (uint32_t seed = 1; seed <= 4; seed++) {
+            ok = ok && fuzzPSG(scc::EMU2149::Engine::Event, rate, seed) == fuzzPSG(scc::EMU2149::Engine::Tick, rate, seed);
+        }
+    }
+    printf("- PSG Event = Tick: %s\n", ok ? "OK" : "FAILED");
+    return ok;
+}
+
+// Hashes of fuzzPSG and fuzzSCC (seed 1) at checkRates with the header that stepped the ticks of each sample one by one
+// and did not skip the idle chips (40c8fd7)
+static const uint64_t hashScalar[4] = {0x73ABC0FD39DB1270ull, 0xADE66DEEC1C1CEF1ull, 0x39EABF9AF13394F4ull, 0x8107F4B52EA98039ull};
+static const uint64_t hashEvent[4] = {0x024D92B43507608Eull, 0xBA4153A8E33530A0ull, 0x91D02AC0B75D1C19ull, 0x74CB2B82EADDB2F0ull};
+static const uint64_t hashBlep[4] = {0x0F4453865C67BCE0ull, 0x37802FB1BFE889DEull, 0xAD50F24657399FFEull, 0xC92405AFCABA9AC0ull};
+static const uint64_t hashAnalytic[4] = {0x7FCD4D048CBD1883ull, 0x4BA8AB5823063535ull, 0x14F69B5B87B52430ull, 0x8AA45CD9AF97ED54ull};
+static const uint64_t hashMipmap[4] = {0x9C42E2A6A95B3242ull, 0xEA764BBDA6DFB10Bull, 0xDF106D8CF9C8E7D0ull, 0x0E098D94472D424Eull};
+
+static bool checkHashPSG(scc::EMU2149::Engine engine, const char* name, const uint64_t* hashes)
+{
+    bool ok = true;
+    for (int i = 0; i < 4; i++) {
+        ok = ok && fuzzPSG(engine, checkRates[i], 1) == hashes[i];
+    }
+    printf("- PSG %s output hash: %s\n", name, ok ? "OK" : "FAILED");
+    return ok;
+}
+
+static bool checkHashSCC(scc::EMU2212::Engine engine, const char* name, const uint64_t* hashes)
+{
+    bool ok = true;
+    for (int i = 0; i < 4; i++) {
+        ok = ok && fuzzSCC(engine, checkRates[i], 1) == hashes[i];
+    }
+    printf("- SCC %s output hash: %s\n", name, ok ? "OK" : "FAILED");
+    return ok;
+}
+
+// The stems sum to the output within the tolerance (the stems are rounded one by one), and the output is the same as calcBlock
+static bool checkStemsPSG(scc::EMU2149::Engine engine, const char* name, int tolerance)
+{
+    int16_t stems[3][1920];
+    int16_t* ptr[3] = {stems[0], stems[1], stems[2]};
+    int16_t buf[1920];
+    int16_t ref[1920];
+    bool ok = true;
+    int worst = 0;
+    for (uint32_t rate : checkRates) {
+        Fuzz fuzz(1), same(1);
+        scc::EMU2149 psg(3579545, rate), mono(3579545, rate);
+        resetRandomPSG(&psg, engine);
+        resetRandomPSG(&mono, engine);
+        for (int round = 0; round < 100; round++) {
+            writeRandomPSG(fuzz, &psg);
+            writeRandomPSG(same, &mono);
+            int samples = 1 + (int)fuzz.below(rate / 100);
+            same.below(rate / 100);
+            psg.calcBlockStems(ptr, buf, samples);
+            mono.calcBlock(ref, samples);
+            for (int i = 0; i < samples; i++) {
+                int diff = abs(stems[0][i] + stems[1][i] + stems[2][i] - buf[i]);
+                worst = worst < diff ? diff : worst;
+                ok = ok && buf[i] == ref[i];
+            }
+        }
+    }
+    ok = ok && worst <= tolerance;
+    printf("- PSG %s stems: %s (sum within %d LSB)\n", name, ok ? "OK" : "FAILED", worst);
+    return ok;
+}
+
+static bool checkStemsSCC(scc::EMU2212::Engine engine, const char* name, int tolerance)
+{
+    int16_t stems[5][1920];
+    int16_t* ptr[5] = {stems[0], stems[1], stems[2], stems[3], stems[4]};
+    int16_t buf[1920];
+    int16_t ref[1920];
+    bool ok = true;
+    int worst = 0;
+    for (uint32_t rate : checkRates) {
+        Fuzz fuzz(1), same(1);
+        scc::EMU2212 scc(3579545, rate), mono(3579545, rate);
+        resetRandomSCC(fuzz, &scc, engine);
+        resetRandomSCC(same, &mono, engine);
+        for (int round = 0; round < 100; round++) {
+            writeRandomSCC(fuzz, &scc);
+            writeRandomSCC(same, &mono);
+            int samples = 1 + (int)fuzz.below(rate / 100);
+            same.below(rate / 100);
+            scc.calcBlockStems(ptr, buf, samples);
+            mono.calcBlock(ref, samples);
+            for (int i = 0; i < samples; i++) {
+                int diff = abs(stems[0][i] + stems[1][i] + stems[2][i] + stems[3][i] + stems[4][i] - buf[i]);
+                worst = worst < diff ? diff : worst;
+                ok = ok && buf[i] == ref[i];
+            }
+        }
+    }
+    ok = ok && worst <= tolerance;
+    printf("- SCC %s stems: %s (sum within %d LSB)\n", name, ok ? "OK" : "FAILED", worst);
+    return ok;
+}
+
+// The Simd core is bit-exact with the Scalar core
+static bool checkSimd()
+{
+    if (!scc::EMU2212::isSimdSupported()) {
+        puts("- SCC Simd = Scalar: skipped (AVX2 is not supported)");
+        return true;
+    }
+    bool ok = true;
+    for (uint32_t rate : checkRates) {
+        for (uint32_t seed = 1; seed <= 4; seed++) {
+            ok = ok && fuzzSCC(scc::EMU2212::Engine::Simd, rate, seed) == fuzzSCC(scc::EMU2212::Engine::Scalar, rate, seed);
+        }
+    }
+    printf("- SCC Simd = Scalar: %s\n", ok ? "OK" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    bool check = 1 < argc && 0 == strcmp(argv[1], "--check");
+    if (check) {
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        puts("usage: vgmbench [--check] /path/to/input/file.vgm [seconds]");
+        return -1;
+    }
+    std::vector<uint8_t> vgm;
+    if (!readFile(argv[1], vgm)) {
+        puts("Can not read VGM file.");
+        return -1;
+    }
+    if (check) {
+        puts("Identity checks:");
+        bool ok = checkState(vgm);
+        ok = checkEvent() && ok;
+        ok = checkHashPSG(scc::EMU2149::Engine::Event, "Event", hashEvent) && ok;
+        ok = checkHashPSG(scc::EMU2149::Engine::Blep, "Blep", hashBlep) && ok;
+        ok = checkHashSCC(scc::EMU2212::Engine::Scalar, "Scalar", hashScalar) && ok;
+        ok = checkSimd() && ok;
+        ok = checkHashSCC(scc::EMU2212::Engine::Analytic, "Analytic", hashAnalytic) && ok;
+        ok = checkHashSCC(scc::EMU2212::Engine::Mipmap, "Mipmap", hashMipmap) && ok;
+        ok = checkStemsPSG(scc::EMU2149::Engine::Tick, "Tick", 2) && ok;
+        ok = checkStemsPSG(scc::EMU2149::Engine::Event, "Event", 2) && ok;
+        ok = checkStemsPSG(scc::EMU2149::Engine::Blep, "Blep", 1) && ok;
+        ok = checkStemsPSG(scc::EMU2149::Engine::Fir, "Fir", 1) && ok;
+        ok = checkStemsSCC(scc::EMU2212::Engine::Scalar, "Scalar", 0) && ok;
+        ok = checkStemsSCC(scc::EMU2212::Engine::Simd, "Simd", 0) && ok;
+        ok = checkStemsSCC(scc::EMU2212::Engine::Analytic, "Analytic", 0) && ok;
+        ok = checkStemsSCC(scc::EMU2212::Engine::Mipmap, "Mipmap", 0) && ok;
+        ok = checkStemsSCC(scc::EMU2212::Engine::Fir, "Fir", 2) && ok;
+        puts(ok ? "All checks passed." : "Some checks FAILED.");
+        return ok ? 0 : 1;
+    }
+    int seconds = 2 < argc ? atoi(argv[2]) : 60;
+    if (seconds < 1) {
+        seconds = 1;
+    }
+    scc::VgmDriver scc;
+    if (!scc.load(vgm.data(), vgm.size())) {
+        puts("scc.load failed! (invalid data, version or chipset)");
+        return -1;
+    }
+    benchRender(vgm, seconds);
+    puts("Specialized driver throughput (callback 64 samples):");
+    benchDriver<scc::VgmDriver>(vgm, seconds, "generic");
+    benchDriver<scc::BasicVgmDriver<scc::VgmChips::All, 44100>>(vgm, seconds, "All, 44100");
+    benchDriver<scc::BasicVgmDriver<scc::VgmChips::SCC, 44100>>(vgm, seconds, "SCC, 44100");
+    puts("Stereo render throughput (callback 1024 samples):");
+    benchStereo<int16_t>(vgm, seconds, "int16 center", false);
+    benchStereo<float>(vgm, seconds, "float center", false);
+    benchStereo<int16_t>(vgm, seconds, "int16 panned", true);
+    benchStereo<float>(vgm, seconds, "float panned", true);
+    benchStems(vgm, seconds);
+    puts("PSG core throughput:");
+    benchEnginePSG(scc::EMU2149::Engine::Tick, "Tick", seconds);
+    benchEnginePSG(scc::EMU2149::Engine::Event, "Event", seconds);
+    benchEnginePSG(scc::EMU2149::Engine::Blep, "Blep", seconds);
+    benchEnginePSG(scc::EMU2149::Engine::Fir, "FirLow", seconds, scc::Decimator::Quality::Low);
+    benchEnginePSG(scc::EMU2149::Engine::Fir, "FirMed", seconds, scc::Decimator::Quality::Medium);
+    benchEnginePSG(scc::EMU2149::Engine::Fir, "FirHigh", seconds, scc::Decimator::Quality::High);
+    puts("SCC core throughput:");
+    benchEngineSCC(scc::EMU2212::Engine::Scalar, "Scalar", seconds);
+    benchEngineSCC(scc::EMU2212::Engine::Simd, "Simd", seconds);
+    benchEngineSCC(scc::EMU2212::Engine::Analytic, "Analytic", seconds);
+    benchEngineSCC(scc::EMU2212::Engine::Mipmap, "Mipmap", seconds);
+    benchEngineSCC(scc::EMU2212::Engine::Fir, "FirLow", seconds, scc::Decimator::Quality::Low);
+    benchEngineSCC(scc::EMU2212::Engine::Fir, "FirMed", seconds, scc::Decimator::Quality::Medium);
+    benchEngineSCC(scc::EMU2212::Engine::Fir, "FirHigh", seconds, scc::Decimator::Quality::High);
+    benchIdle(seconds);
+    puts("SCC core quality:");
+    compareEngineSCC(vgm, scc::EMU2212::Engine::Scalar, "Scalar", seconds);
+    compareEngineSCC(vgm, scc::EMU2212::Engine::Analytic, "Analytic", seconds);
+    compareEngineSCC(vgm, scc::EMU2212::Engine::Mipmap, "Mipmap", seconds);
+    compareEngineSCC(vgm, scc::EMU2212::Engine::Fir, "FirLow", seconds, scc::Decimator::Quality::Low);
+    compareEngineSCC(vgm, scc::EMU2212::Engine::Fir, "FirMed", seconds, scc::Decimator::Quality::Medium);
+    compareEngineSCC(vgm, scc::EMU2212::Engine::Fir, "FirHigh", seconds, scc::Decimator::Quality::High);
+    benchParallel(vgm, seconds);
+    benchConcurrentChips(vgm, seconds);
+    puts("Streaming player (256 samples callback in real time):");
+    benchStreaming(vgm, seconds, 1024);
+    benchStreaming(vgm, seconds, 4410);
+    benchSeek(vgm, scc::VgmDriver::SeekMode::Emulation, 0);
+    benchSeek(vgm, scc::VgmDriver::SeekMode::Shadow, 0);
+    benchSeek(vgm, scc::VgmDriver::SeekMode::Shadow, 44100);
+    benchState(vgm);
+    benchSong(vgm);
+    benchSfx(vgm, seconds);
+    puts("Loop cache (callback 256 samples):");
+    benchLoopCache(vgm, seconds, scc::VgmDriver::LoopCacheMode::Exact, "Exact");
+    benchLoopCache(vgm, seconds, scc::VgmDriver::LoopCacheMode::Lossy, "Lossy");
+    return 0;
+}
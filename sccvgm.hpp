@@ -27,28 +27,322 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
+#if !defined(SCCVGM_NO_THREADS)
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#endif
+
+// Define SCCVGM_NO_SIMD to build the scalar emulation cores only
+#if !defined(SCCVGM_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define SCCVGM_AVX2 __attribute__((target("avx2")))
+#define SCCVGM_AVX2_RUNTIME_CHECK
+#elif defined(__AVX2__)
+#define SCCVGM_AVX2
+#endif
+#endif
 
 namespace scc
 {
 
-class EMU2149
+/**
+ * Polyphase FIR decimator shared by the emulation cores (EMU2149::Engine::Fir and EMU2212::Engine::Fir).
+ * A core writes its output at every tick of the chip (a block of ticks at once with reserve and advance, or each
+ * tick with push), and takes each output sample from the windowed sinc at the sub-tick position of the sample,
+ * so an output sample costs a dot product of the taps (see Quality).
+ * The coefficients are built once for each quality and steps, and shared by all the instances.
+ */
+class Decimator
 {
+  public:
+    enum class Quality {
+        Low,    // 4 zero crossings of the sinc at the output rate
+        Medium, // 8 zero crossings
+        High,   // 16 zero crossings
+    };
+
+  private:
+    enum {
+        MaxTableSize = 65536, // floats of the coefficients: the phases are reduced to fit the taps
+        MinPhases = 16,
+        MaxPhases = 256,
+        BlockTicks = 4096, // ticks that reserve can take at once (at least the ticks of an output sample)
+    };
+
+    // coefficients for a quality and steps (immutable, and never freed)
+    struct Table {
+        Quality quality;
+        uint32_t realstep;
+        uint32_t tickstep;
+        int taps;   // multiple of 8
+        int phases;
+        float* h;   // (phases + 1) x taps, from the oldest tick to the latest tick
+        const Table* next;
+    };
+
+    const Table* table;
+    float* history; // the latest taps ticks end at pos (moved to the head when the room runs out)
+    int capacity;
+    int pos;
+    int blockTicks;
+    Quality quality;
+
+  public:
+    Decimator()
+    {
+        table = NULL;
+        history = NULL;
+        capacity = 0;
+        pos = 0;
+        blockTicks = 0;
+        quality = Quality::Medium;
+    }
+
+    ~Decimator()
+    {
+        free(history);
+    }
+
+    Decimator(const Decimator&) = delete;
+    Decimator& operator=(const Decimator&) = delete;
+
+    static bool isSimdSupported()
+    {
+#if defined(SCCVGM_AVX2_RUNTIME_CHECK)
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#elif defined(SCCVGM_AVX2)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void setQuality(Quality quality)
+    {
+        if (this->quality != quality) {
+            this->quality = quality;
+            this->table = NULL; // taken at the next prepare
+        }
+    }
+
+    Quality getQuality() { return quality; }
+
+    /**
+     * Take the coefficients for the steps of the core: an output sample is realstep, and a tick is tickstep.
+     * Returns false if the memory can not be allocated (the core should render without the decimator).
+     */
+    bool prepare(uint32_t realstep, uint32_t tickstep)
+    {
+        if (table && table->realstep == realstep && table->tickstep == tickstep) {
+            return true;
+        }
+        table = find_table(quality, realstep, tickstep);
+        if (!table) {
+            return false;
+        }
+        blockTicks = (int)(realstep / tickstep) + 1;
+        blockTicks = blockTicks < BlockTicks ? BlockTicks : blockTicks;
+        if (capacity < table->taps + blockTicks) {
+            free(history);
+            capacity = table->taps + blockTicks;
+            history = (float*)malloc(capacity * sizeof(float));
+            if (!history) {
+                capacity = 0;
+                table = NULL;
+                return false;
+            }
+        }
+        clear(0);
+        return true;
+    }
+
+    // The most ticks that reserve takes at once (at least the ticks of an output sample)
+    int getBlockTicks() { return blockTicks; }
+
+    void clear(float value)
+    {
+        if (!table) {
+            return;
+        }
+        for (int i = 0; i < table->taps; i++) {
+            history[i] = value;
+        }
+        pos = table->taps;
+    }
+
+    // Room for the ticks to write (up to getBlockTicks), which are taken by advance
+    inline float* reserve(int ticks)
+    {
+        if (capacity < pos + ticks) {
+            compact();
+        }
+        return &history[pos];
+    }
+
+    inline void advance(int ticks) { pos += ticks; }
+
+    inline void push(float value)
+    {
+        if (pos == capacity) {
+            compact();
+        }
+        history[pos++] = value;
+    }
+
+    // push the value repeated by the ticks
+    inline void fill(float value, uint32_t ticks)
+    {
+        if ((uint32_t)table->taps < ticks) {
+            ticks = table->taps;
+        }
+        float* x = reserve((int)ticks);
+        for (uint32_t i = 0; i < ticks; i++) {
+            x[i] = value;
+        }
+        pos += ticks;
+    }
+
+    // Output sample after the ticks taken: time is the time of the core to the next tick (0 <= time < tickstep)
+    inline float output(uint32_t time)
+    {
+        const int taps = table->taps;
+        const uint32_t tickstep = table->tickstep;
+        int p = (int)(((uint64_t)(tickstep - time) * table->phases + tickstep / 2) / tickstep);
+        const float* h = &table->h[p * taps];
+        const float* x = &history[pos - taps];
+#if defined(SCCVGM_AVX2)
+        if (isSimdSupported()) {
+            return dotAVX2(h, x, taps);
+        }
+#endif
+        float sum[4] = {0, 0, 0, 0};
+        for (int j = 0; j < taps; j += 4) {
+            sum[0] += h[j] * x[j];
+            sum[1] += h[j + 1] * x[j + 1];
+            sum[2] += h[j + 2] * x[j + 2];
+            sum[3] += h[j + 3] * x[j + 3];
+        }
+        return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
+
+    static inline int16_t clamp(float value)
+    {
+        return (int16_t)lrintf(value < -32768.0f ? -32768.0f : (32767.0f < value ? 32767.0f : value));
+    }
+
   private:
+    // move the latest taps ticks to the head
+    inline void compact()
+    {
+        const int taps = table->taps;
+        memmove(history, &history[pos - taps], taps * sizeof(float));
+        pos = taps;
+    }
+
+    // The table of the quality and steps (built at the first use)
+    static const Table* find_table(Quality quality, uint32_t realstep, uint32_t tickstep)
+    {
+#if !defined(SCCVGM_NO_THREADS)
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+#endif
+        static const Table* tables = NULL;
+        for (const Table* t = tables; t; t = t->next) {
+            if (t->quality == quality && t->realstep == realstep && t->tickstep == tickstep) {
+                return t;
+            }
+        }
+        Table* table = (Table*)malloc(sizeof(Table));
+        if (!table) {
+            return NULL;
+        }
+        const double pi = 3.14159265358979323846;
+        double ratio = (double)realstep / tickstep; // ticks per output sample
+        double cutoff = 0.45 / (ratio < 1 ? 1 : ratio); // cycles per tick
+        int zeros = Quality::Low == quality ? 4 : (Quality::Medium == quality ? 8 : 16);
+        int taps = ((int)ceil(zeros / cutoff) + 7) & ~7;
+        int phases = MaxTableSize / taps;
+        phases = phases < MinPhases ? MinPhases : (MaxPhases < phases ? MaxPhases : phases);
+        table->h = (float*)malloc((phases + 1) * taps * sizeof(float));
+        if (!table->h) {
+            free(table);
+            return NULL;
+        }
+        double center = taps / 2.0;
+        for (int p = 0; p <= phases; p++) {
+            float* h = &table->h[p * taps];
+            double sum = 0;
+            for (int j = 0; j < taps; j++) {
+                // the latest tick (j = taps - 1) is p / phases ticks before the output sample
+                double t = (double)p / phases + (taps - 1 - j) - center;
+                double x = 2 * cutoff * t;
+                double sinc = 0 == x ? 1 : sin(pi * x) / (pi * x);
+                double w = fabs(t) < center ? 0.42 + 0.5 * cos(pi * t / center) + 0.08 * cos(2 * pi * t / center) : 0;
+                h[j] = (float)(sinc * w);
+                sum += h[j];
+            }
+            for (int j = 0; j < taps; j++) {
+                h[j] = (float)(h[j] / sum); // unity gain at DC
+            }
+        }
+        table->quality = quality;
+        table->realstep = realstep;
+        table->tickstep = tickstep;
+        table->taps = taps;
+        table->phases = phases;
+        table->next = tables;
+        tables = table;
+        return table;
+    }
+
+#if defined(SCCVGM_AVX2)
+    SCCVGM_AVX2 static float dotAVX2(const float* h, const float* x, int taps)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (int j = 0; j < taps; j += 8) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(&h[j]), _mm256_loadu_ps(&x[j])));
+        }
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+        half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+        return _mm_cvtss_f32(half);
+    }
+#endif
+};
+
+class EMU2149
+{
+  public:
+    enum class Engine {
+        Tick,  // reference implementation: update_output every tick
+        Event, // bit-exact with Tick, skips the ticks between the tone, noise and envelope edges that change the output
+        Blep,  // band-limited: inserts a minBLEP at each edge at the output rate (no mute by freq_limit)
+        Fir,   // band-limited: decimates the output of every tick with the polyphase FIR of Decimator (no mute by freq_limit)
+    };
+
     typedef struct
     {
+        // hot: read or updated by the ticks
         const uint32_t* voltbl;
-        uint8_t reg[0x20];
         int32_t out;
-        uint32_t clk, rate, base_incr;
-        uint8_t clk_div;
+        uint32_t base_incr;
+        uint32_t base_count;
+        uint32_t realstep;
+        uint32_t psgtime;
+        uint32_t psgstep;
+        uint32_t freq_limit;
+        uint32_t mask;
         uint16_t count[3];
-        uint8_t volume[3];
         uint16_t freq[3];
+        uint8_t volume[3];
         uint8_t edge[3];
         uint8_t tmask[3];
         uint8_t nmask[3];
-        uint32_t mask;
-        uint32_t base_count;
         uint8_t env_ptr;
         uint8_t env_face;
         uint8_t env_continue;
@@ -62,74 +356,233 @@ class EMU2149
         uint8_t noise_scaler;
         uint8_t noise_count;
         uint8_t noise_freq;
-        uint32_t realstep;
-        uint32_t psgtime;
-        uint32_t psgstep;
-        uint32_t freq_limit;
-        uint8_t adr;
         int16_t ch_out[3];
+        uint8_t stereo_mask; // bit 2n: left and bit 2n+1: right of the channel n (VGM 0x31)
+        int32_t side_out[2]; // out of the left and right (calcBlockStereo)
+        int32_t stem_out[3]; // out of each channel (calcBlockStems)
+
+        // cold: registers and settings
+        uint8_t reg[0x20];
+        uint32_t clk, rate;
+        uint8_t clk_div;
+        uint8_t adr;
     } Context;
 
-    Context* psg;
+    /**
+     * Emulation state of saveState: fixed-width fields without padding, so that it does not depend on Context
+     * or the compiler. The settings (clock, rate, clock divider, volume mode and engine) are not included.
+     */
+    struct State {
+        uint32_t psgtime;
+        uint32_t base_count;
+        uint32_t mask;
+        uint32_t env_count;
+        uint32_t noise_seed;
+        int32_t out;
+        int32_t side_out[2];
+        int32_t stem_out[3];
+        uint16_t count[3];
+        uint16_t freq[3];
+        uint16_t env_freq;
+        int16_t ch_out[3];
+        uint8_t reg[16];
+        uint8_t volume[3];
+        uint8_t edge[3];
+        uint8_t tmask[3];
+        uint8_t nmask[3];
+        uint8_t env_ptr;
+        uint8_t env_face;
+        uint8_t env_continue;
+        uint8_t env_attack;
+        uint8_t env_alternate;
+        uint8_t env_hold;
+        uint8_t env_pause;
+        uint8_t noise_scaler;
+        uint8_t noise_count;
+        uint8_t noise_freq;
+        uint8_t stereo_mask;
+        uint8_t adr;
+    };
+    static_assert(sizeof(State) == 104, "EMU2149::State must not have padding");
+
+  private:
+    alignas(64) Context psg;
+    Engine engine;
+    int32_t pan[3][2];       // gains of the channels to the left and right (256: 1.0)
+    int32_t side_gain[3][2]; // pan with stereo_mask
+    bool panned;             // side_gain is not 256 for all (the sides differ from out)
+    uint32_t pending_ticks; // ticks skipped by the Event engine, not applied to the counters yet
+    uint32_t event_ticks;   // ticks until the next edge that changes the output
+    bool dirty;             // ch_out must be updated by a tick
+
+    // outputs updated with out by the ticks
+    enum Output {
+        OutputMono,   // out
+        OutputStereo, // side_out as well
+        OutputStems,  // stem_out as well
+    };
+
+    enum {
+        BlepZeroCrossings = 8,
+        BlepOversampling = 64,
+        BlepLength = BlepZeroCrossings * 2, // samples affected by a step
+        BlepRing = 32,
+        BlepTracks = 4, // out, and the left and right (OutputStereo) or the channels (OutputStems)
+    };
+
+    // minimum phase band-limited step minus the unit step, sampled at 1/BlepOversampling of the output rate
+    struct BlepTable {
+        float residual[BlepLength * BlepOversampling + 2];
+        BlepTable();
+    };
+
+    // noise LFSR advanced by 2^k shifts: a linear map over GF(2) given by the images of the 32 bits of the seed
+    struct NoiseJump {
+        uint32_t image[32][32];
+
+        NoiseJump()
+        {
+            for (int b = 0; b < 32; b++) {
+                uint32_t seed = (uint32_t)1 << b;
+                image[0][b] = ((seed & 1) ? seed ^ 0x24000 : seed) >> 1;
+            }
+            for (int k = 1; k < 32; k++) {
+                for (int b = 0; b < 32; b++) {
+                    image[k][b] = apply(image[k - 1], image[k - 1][b]);
+                }
+            }
+        }
+
+        static inline uint32_t apply(const uint32_t* image, uint32_t seed)
+        {
+            uint32_t result = 0;
+            for (int b = 0; seed; b++, seed >>= 1) {
+                if (seed & 1) {
+                    result ^= image[b];
+                }
+            }
+            return result;
+        }
+
+        uint32_t shift(uint32_t seed, uint32_t shifts) const
+        {
+            for (int k = 0; shifts; k++, shifts >>= 1) {
+                if (shifts & 1) {
+                    seed = apply(image[k], seed);
+                }
+            }
+            return seed;
+        }
+    };
+
+    float blep_ring[BlepTracks][BlepRing]; // residuals of the steps to be added to the upcoming samples
+    int blep_pos;
+    int32_t blep_level[BlepTracks]; // level of each track without the residuals
+    int blep_output;                // Output whose tracks follow the steps
 
-    const uint32_t voltbl[2][32] = {
-        /* YM2149 - 32 steps */
-        {0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03, 0x04, 0x05, 0x06, 0x07, 0x09,
-         0x0B, 0x0D, 0x0F, 0x12,
-         0x16, 0x1A, 0x1F, 0x25, 0x2D, 0x35, 0x3F, 0x4C, 0x5A, 0x6A, 0x7F, 0x97,
-         0xB4, 0xD6, 0xFF, 0xFF},
-        /* AY-3-8910 - 16 steps */
-        {0x00, 0x00, 0x03, 0x03, 0x04, 0x04, 0x06, 0x06, 0x09, 0x09, 0x0D, 0x0D,
-         0x12, 0x12, 0x1D, 0x1D,
-         0x22, 0x22, 0x37, 0x37, 0x4D, 0x4D, 0x62, 0x62, 0x82, 0x82, 0xA6, 0xA6,
-         0xD0, 0xD0, 0xFF, 0xFF}};
+    Decimator fir;
+    Decimator fir_extra[3]; // the left and right (OutputStereo), or the channels (OutputStems)
+    int fir_output;         // Output whose decimators follow the ticks
 
-    const uint8_t regmsk[16] = {
-        0xff, 0x0f, 0xff, 0x0f, 0xff, 0x0f, 0x1f, 0x3f,
-        0x1f, 0x1f, 0x1f, 0xff, 0xff, 0x0f, 0xff, 0xff};
+    // volume tables shared by the instances
+    static const uint32_t* volume_table(int type)
+    {
+        static constexpr uint32_t voltbl[2][32] = {
+            /* YM2149 - 32 steps */
+            {0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03, 0x04, 0x05, 0x06, 0x07, 0x09,
+             0x0B, 0x0D, 0x0F, 0x12,
+             0x16, 0x1A, 0x1F, 0x25, 0x2D, 0x35, 0x3F, 0x4C, 0x5A, 0x6A, 0x7F, 0x97,
+             0xB4, 0xD6, 0xFF, 0xFF},
+            /* AY-3-8910 - 16 steps */
+            {0x00, 0x00, 0x03, 0x03, 0x04, 0x04, 0x06, 0x06, 0x09, 0x09, 0x0D, 0x0D,
+             0x12, 0x12, 0x1D, 0x1D,
+             0x22, 0x22, 0x37, 0x37, 0x4D, 0x4D, 0x62, 0x62, 0x82, 0x82, 0xA6, 0xA6,
+             0xD0, 0xD0, 0xFF, 0xFF}};
+        return voltbl[type];
+    }
+
+    static uint8_t register_mask(uint32_t reg)
+    {
+        static constexpr uint8_t regmsk[16] = {
+            0xff, 0x0f, 0xff, 0x0f, 0xff, 0x0f, 0x1f, 0x3f,
+            0x1f, 0x1f, 0x1f, 0xff, 0xff, 0x0f, 0xff, 0xff};
+        return regmsk[reg];
+    }
 
-    const int GETA_BITS = 24;
+    static const int GETA_BITS = 24;
 
     inline int PSG_MASK_CH(int x) { return (1 << (x)); }
 
   public:
     EMU2149(uint32_t clock, uint32_t rate)
     {
-        psg = new Context();
+        memset(&psg, 0, sizeof(psg));
+        engine = Engine::Event;
+        for (int i = 0; i < 3; i++) {
+            pan[i][0] = 256;
+            pan[i][1] = 256;
+        }
+        psg.stereo_mask = 0x3F;
+        panned = false;
+        pending_ticks = 0;
+        event_ticks = 0;
+        dirty = true;
+        blep_clear();
+        fir_output = OutputMono;
         setVolumeMode(0);
-        psg->clk = clock;
-        psg->clk_div = 0;
-        psg->rate = rate ? rate : 44100;
+        psg.clk = clock;
+        psg.clk_div = 0;
+        psg.rate = rate ? rate : 44100;
         internal_refresh();
         setMask(0x00);
     }
 
-    ~EMU2149()
-    {
-        delete psg;
-    }
-
     uint32_t getFrequency(int ch)
     {
         if (0 <= ch && ch < 3) {
-            return 0 < psg->volume[ch] ? psg->freq[ch] : 0;
+            return 0 < psg.volume[ch] ? psg.freq[ch] : 0;
         } else {
             return 0;
         }
     }
 
+    void setEngine(Engine engine)
+    {
+        flush_ticks();
+        Engine previous = this->engine;
+        this->engine = engine;
+        if (Engine::Blep == engine && Engine::Blep != previous) {
+            blep_clear();
+        }
+        if (Engine::Fir == engine && Engine::Fir != previous) {
+            fir_clear();
+        }
+    }
+
+    Engine getEngine() { return engine; }
+
+    // Quality of Engine::Fir
+    void setFirQuality(Decimator::Quality quality)
+    {
+        fir.setQuality(quality);
+        for (int i = 0; i < 3; i++) {
+            fir_extra[i].setQuality(quality);
+        }
+        fir_clear();
+    }
+
     void setClock(uint32_t clock)
     {
-        if (psg->clk != clock) {
-            psg->clk = clock;
+        if (psg.clk != clock) {
+            psg.clk = clock;
             internal_refresh();
         }
     }
 
     void setClockDivider(uint8_t enable)
     {
-        if (psg->clk_div != enable) {
-            psg->clk_div = enable;
+        if (psg.clk_div != enable) {
+            psg.clk_div = enable;
             internal_refresh();
         }
     }
@@ -137,96 +590,253 @@ class EMU2149
     void setRate(uint32_t rate)
     {
         uint32_t r = rate ? rate : 44100;
-        if (psg->rate != r) {
-            psg->rate = r;
+        if (psg.rate != r) {
+            psg.rate = r;
             internal_refresh();
         }
     }
 
     void setVolumeMode(int type)
     {
+        flush_ticks();
         switch (type) {
             case 1:
-                psg->voltbl = voltbl[0]; /* YM2149 */
+                psg.voltbl = volume_table(0); /* YM2149 */
                 break;
             case 2:
-                psg->voltbl = voltbl[1]; /* AY-3-8910 */
+                psg.voltbl = volume_table(1); /* AY-3-8910 */
                 break;
             default:
-                psg->voltbl = voltbl[0]; /* fallback: YM2149 */
+                psg.voltbl = volume_table(0); /* fallback: YM2149 */
                 break;
         }
     }
 
     uint32_t setMask(uint32_t mask)
     {
-        uint32_t ret = 0;
-        if (psg) {
-            ret = psg->mask;
-            psg->mask = mask;
-        }
+        flush_ticks();
+        uint32_t ret = psg.mask;
+        psg.mask = mask;
         return ret;
     }
 
     uint32_t toggleMask(uint32_t mask)
     {
-        uint32_t ret = 0;
-        if (psg) {
-            ret = psg->mask;
-            psg->mask ^= mask;
-        }
+        flush_ticks();
+        uint32_t ret = psg.mask;
+        psg.mask ^= mask;
         return ret;
     }
 
+    // Gains of the channel to the left and right of calcBlockStereo (0 to 256, default 256 for both)
+    void setPan(int ch, int left, int right)
+    {
+        if (0 <= ch && ch < 3) {
+            pan[ch][0] = left < 0 ? 0 : (256 < left ? 256 : left);
+            pan[ch][1] = right < 0 ? 0 : (256 < right ? 256 : right);
+            update_pan();
+        }
+    }
+
+    // AY-3-8910 stereo mask (VGM 0x31): bit 2n enables the channel n on the left, and bit 2n+1 on the right
+    void setStereoMask(uint8_t mask)
+    {
+        psg.stereo_mask = mask & 0x3F;
+        update_pan();
+    }
+
     void reset()
     {
         int i;
 
-        psg->base_count = 0;
+        flush_ticks();
+        psg.base_count = 0;
 
         for (i = 0; i < 3; i++) {
-            psg->count[i] = 0;
-            psg->freq[i] = 0;
-            psg->edge[i] = 0;
-            psg->volume[i] = 0;
-            psg->ch_out[i] = 0;
+            psg.count[i] = 0;
+            psg.freq[i] = 0;
+            psg.edge[i] = 0;
+            psg.volume[i] = 0;
+            psg.ch_out[i] = 0;
         }
 
-        psg->mask = 0;
+        psg.mask = 0;
 
         for (i = 0; i < 16; i++)
-            psg->reg[i] = 0;
-        psg->adr = 0;
+            psg.reg[i] = 0;
+        psg.adr = 0;
+
+        psg.noise_seed = 0xffff;
+        psg.noise_scaler = 0;
+        psg.noise_count = 0;
+        psg.noise_freq = 0;
+
+        for (i = 0; i < 3; i++) {
+            psg.tmask[i] = 0;
+            psg.nmask[i] = 0;
+        }
+
+        psg.env_ptr = 0;
+        psg.env_face = 0;
+        psg.env_continue = 0;
+        psg.env_attack = 0;
+        psg.env_alternate = 0;
+        psg.env_hold = 0;
+        psg.env_freq = 0;
+        psg.env_count = 0;
+        psg.env_pause = 1;
+
+        psg.psgtime = 0;
+        psg.out = 0;
+        memset(psg.side_out, 0, sizeof(psg.side_out));
+        memset(psg.stem_out, 0, sizeof(psg.stem_out));
+        psg.stereo_mask = 0x3F;
+        update_pan();
+        blep_clear();
+        fir_clear();
+    }
+
+    void saveContext(Context* ctx)
+    {
+        flush_ticks();
+        memcpy(ctx, &psg, sizeof(Context));
+    }
+
+    // The volume mode (voltbl) is a setting of the instance, and it is not loaded from the context
+    void loadContext(const Context* ctx)
+    {
+        const uint32_t* voltbl = psg.voltbl;
+        memcpy(&psg, ctx, sizeof(Context));
+        psg.voltbl = voltbl;
+        pending_ticks = 0;
+        dirty = true;
+        panned = true; // keep side_out of the context
+        update_pan();
+        blep_clear();
+        fir_clear();
+    }
 
-        psg->noise_seed = 0xffff;
-        psg->noise_scaler = 0;
-        psg->noise_count = 0;
-        psg->noise_freq = 0;
+    void saveState(State* state)
+    {
+        flush_ticks();
+        memset(state, 0, sizeof(State));
+        state->psgtime = psg.psgtime;
+        state->base_count = psg.base_count;
+        state->mask = psg.mask;
+        state->env_count = psg.env_count;
+        state->noise_seed = psg.noise_seed;
+        state->out = psg.out;
+        for (int i = 0; i < 2; i++) {
+            state->side_out[i] = psg.side_out[i];
+        }
+        for (int i = 0; i < 3; i++) {
+            state->stem_out[i] = psg.stem_out[i];
+            state->count[i] = psg.count[i];
+            state->freq[i] = psg.freq[i];
+            state->ch_out[i] = psg.ch_out[i];
+            state->volume[i] = psg.volume[i];
+            state->edge[i] = psg.edge[i];
+            state->tmask[i] = psg.tmask[i];
+            state->nmask[i] = psg.nmask[i];
+        }
+        state->env_freq = psg.env_freq;
+        memcpy(state->reg, psg.reg, sizeof(state->reg));
+        state->env_ptr = psg.env_ptr;
+        state->env_face = psg.env_face;
+        state->env_continue = psg.env_continue;
+        state->env_attack = psg.env_attack;
+        state->env_alternate = psg.env_alternate;
+        state->env_hold = psg.env_hold;
+        state->env_pause = psg.env_pause;
+        state->noise_scaler = psg.noise_scaler;
+        state->noise_count = psg.noise_count;
+        state->noise_freq = psg.noise_freq;
+        state->stereo_mask = psg.stereo_mask;
+        state->adr = psg.adr;
+    }
 
-        psg->env_ptr = 0;
-        psg->env_freq = 0;
-        psg->env_count = 0;
-        psg->env_pause = 1;
+    // Whether the state can be loaded to this instance: the indexes and the timing are in range
+    bool verifyState(const State* state)
+    {
+        if (psg.psgstep <= state->psgtime || (1u << GETA_BITS) <= state->base_count) {
+            return false;
+        }
+        for (int i = 0; i < 3; i++) {
+            if (0xFFF < state->freq[i] || 63 < state->volume[i] || 1 < state->edge[i]) {
+                return false;
+            }
+        }
+        return state->env_ptr < 32 && state->noise_freq < 32 && state->stereo_mask < 64 && state->adr < 32;
+    }
 
-        psg->out = 0;
+    /**
+     * Restore the state of saveState as loadContext does (the volume mode and the engine are kept).
+     * It returns false without any change if verifyState fails.
+     */
+    bool loadState(const State* state)
+    {
+        if (!verifyState(state)) {
+            return false;
+        }
+        psg.psgtime = state->psgtime;
+        psg.base_count = state->base_count;
+        psg.mask = state->mask;
+        psg.env_count = state->env_count;
+        psg.noise_seed = state->noise_seed;
+        psg.out = state->out;
+        for (int i = 0; i < 2; i++) {
+            psg.side_out[i] = state->side_out[i];
+        }
+        for (int i = 0; i < 3; i++) {
+            psg.stem_out[i] = state->stem_out[i];
+            psg.count[i] = state->count[i];
+            psg.freq[i] = state->freq[i];
+            psg.ch_out[i] = state->ch_out[i];
+            psg.volume[i] = state->volume[i];
+            psg.edge[i] = state->edge[i];
+            psg.tmask[i] = state->tmask[i];
+            psg.nmask[i] = state->nmask[i];
+        }
+        psg.env_freq = state->env_freq;
+        memset(psg.reg, 0, sizeof(psg.reg));
+        memcpy(psg.reg, state->reg, sizeof(state->reg));
+        psg.env_ptr = state->env_ptr;
+        psg.env_face = state->env_face;
+        psg.env_continue = state->env_continue;
+        psg.env_attack = state->env_attack;
+        psg.env_alternate = state->env_alternate;
+        psg.env_hold = state->env_hold;
+        psg.env_pause = state->env_pause;
+        psg.noise_scaler = state->noise_scaler;
+        psg.noise_count = state->noise_count;
+        psg.noise_freq = state->noise_freq;
+        psg.stereo_mask = state->stereo_mask;
+        psg.adr = state->adr;
+        pending_ticks = 0;
+        dirty = true;
+        panned = true; // keep side_out of the state
+        update_pan();
+        blep_clear();
+        fir_clear();
+        return true;
     }
 
     uint8_t readIO()
     {
-        return (uint8_t)(psg->reg[psg->adr]);
+        return (uint8_t)(psg.reg[psg.adr]);
     }
 
     uint8_t readReg(uint32_t reg)
     {
-        return (uint8_t)(psg->reg[reg & 0x1f]);
+        return (uint8_t)(psg.reg[reg & 0x1f]);
     }
 
     void writeIO(uint32_t adr, uint32_t val)
     {
         if (adr & 1)
-            writeReg(psg->adr, val);
+            writeReg(psg.adr, val);
         else
-            psg->adr = val & 0x1f;
+            psg.adr = val & 0x1f;
     }
 
     void writeReg(uint32_t reg, uint32_t val)
@@ -236,9 +846,10 @@ class EMU2149
         if (reg > 15)
             return;
 
-        val &= regmsk[reg];
+        flush_ticks();
+        val &= register_mask(reg);
 
-        psg->reg[reg] = (uint8_t)val;
+        psg.reg[reg] = (uint8_t)val;
 
         switch (reg) {
             case 0:
@@ -248,41 +859,41 @@ class EMU2149
             case 3:
             case 5:
                 c = reg >> 1;
-                psg->freq[c] = ((psg->reg[c * 2 + 1] & 15) << 8) + psg->reg[c * 2];
+                psg.freq[c] = ((psg.reg[c * 2 + 1] & 15) << 8) + psg.reg[c * 2];
                 break;
 
             case 6:
-                psg->noise_freq = val & 31;
+                psg.noise_freq = val & 31;
                 break;
 
             case 7:
-                psg->tmask[0] = (val & 1);
-                psg->tmask[1] = (val & 2);
-                psg->tmask[2] = (val & 4);
-                psg->nmask[0] = (val & 8);
-                psg->nmask[1] = (val & 16);
-                psg->nmask[2] = (val & 32);
+                psg.tmask[0] = (val & 1);
+                psg.tmask[1] = (val & 2);
+                psg.tmask[2] = (val & 4);
+                psg.nmask[0] = (val & 8);
+                psg.nmask[1] = (val & 16);
+                psg.nmask[2] = (val & 32);
                 break;
 
             case 8:
             case 9:
             case 10:
-                psg->volume[reg - 8] = val << 1;
+                psg.volume[reg - 8] = val << 1;
                 break;
 
             case 11:
             case 12:
-                psg->env_freq = (psg->reg[12] << 8) + psg->reg[11];
+                psg.env_freq = (psg.reg[12] << 8) + psg.reg[11];
                 break;
 
             case 13:
-                psg->env_continue = (val >> 3) & 1;
-                psg->env_attack = (val >> 2) & 1;
-                psg->env_alternate = (val >> 1) & 1;
-                psg->env_hold = val & 1;
-                psg->env_face = psg->env_attack;
-                psg->env_pause = 0;
-                psg->env_ptr = psg->env_face ? 0 : 0x1f;
+                psg.env_continue = (val >> 3) & 1;
+                psg.env_attack = (val >> 2) & 1;
+                psg.env_alternate = (val >> 1) & 1;
+                psg.env_hold = val & 1;
+                psg.env_face = psg.env_attack;
+                psg.env_pause = 0;
+                psg.env_ptr = psg.env_face ? 0 : 0x1f;
                 break;
 
             case 14:
@@ -295,102 +906,713 @@ class EMU2149
     }
     int16_t calc()
     {
-        /* Simple rate converter (See README for detail). */
-        while (psg->realstep > psg->psgtime) {
-            psg->psgtime += psg->psgstep;
-            update_output();
-            psg->out += mix_output();
-            psg->out >>= 1;
-        }
-        psg->psgtime -= psg->realstep;
-        return psg->out;
+        int16_t result;
+        calcBlock(&result, 1);
+        return result;
     }
 
-  private:
-    void internal_refresh()
+    void calcBlock(int16_t* buf, int samples)
     {
-        uint32_t f_master = psg->clk;
-
-        if (psg->clk_div) {
-            f_master /= 2;
+        if (Engine::Event == engine) {
+            calcBlockEvent(buf, samples);
+            return;
+        }
+        if (Engine::Blep == engine) {
+            calcBlockBlep(buf, NULL, samples);
+            return;
+        }
+        if (Engine::Fir == engine) {
+            calcBlockFir(buf, NULL, samples);
+            return;
         }
+        dirty = true; // the ticks below invalidate event_ticks
+        uint32_t realstep = psg.realstep;
+        uint32_t psgstep = psg.psgstep;
+        uint32_t psgtime = psg.psgtime;
+        for (int i = 0; i < samples; i++) {
+            /* Simple rate converter (See README for detail). */
+            while (realstep > psgtime) {
+                psgtime += psgstep;
+                update_output();
+                psg.out += mix_output();
+                psg.out >>= 1;
+            }
+            psgtime -= realstep;
+            buf[i] = (int16_t)psg.out;
+        }
+        psg.psgtime = psgtime;
+    }
 
-        psg->base_incr = 1 << GETA_BITS;
-        psg->realstep = f_master;
-        psg->psgstep = psg->rate * 8;
-        psg->psgtime = 0;
-        psg->freq_limit = (uint32_t)(f_master / 16 / (psg->rate / 2));
+    /**
+     * Render the interleaved left and right samples (buf has samples * 2 elements) with the pans.
+     * The output of both sides is the same as calcBlock while the pans are the default.
+     */
+    void calcBlockStereo(int16_t* buf, int samples)
+    {
+        if (!panned) {
+            // render to the latter half, and spread it from the head
+            calcBlock(&buf[samples], samples);
+            for (int i = 0; i < samples; i++) {
+                int16_t w = buf[samples + i];
+                buf[i * 2] = w;
+                buf[i * 2 + 1] = w;
+            }
+        } else if (Engine::Blep == engine) {
+            calcBlockBlep<OutputStereo>(buf, NULL, samples);
+        } else if (Engine::Fir == engine) {
+            calcBlockFir<OutputStereo>(buf, NULL, samples);
+        } else {
+            calcBlockTicks<OutputStereo>(buf, NULL, samples);
+        }
     }
-    inline void update_output()
+
+    // Render the output of each channel to stems[0-2] (NULL skips the channel), and the output to buf
+    void calcBlockStems(int16_t* const* stems, int16_t* buf, int samples)
     {
-        int i, noise;
-        uint8_t incr;
+        if (Engine::Blep == engine) {
+            calcBlockBlep<OutputStems>(buf, stems, samples);
+        } else if (Engine::Fir == engine) {
+            calcBlockFir<OutputStems>(buf, stems, samples);
+        } else {
+            calcBlockTicks<OutputStems>(buf, stems, samples);
+        }
+    }
 
-        psg->base_count += psg->base_incr;
-        incr = (psg->base_count >> GETA_BITS);
-        psg->base_count &= (1 << GETA_BITS) - 1;
+    /**
+     * Advance the state by the samples without the output.
+     * The state is exactly the same as calcBlock with the Tick or Event engine.
+     */
+    void skip(int samples)
+    {
+        run_long_ticks(count_ticks(samples));
+        if (Engine::Event != engine) {
+            flush_ticks();
+        }
+        if (Engine::Blep == engine) {
+            blep_clear();
+        }
+        if (Engine::Fir == engine) {
+            fir_clear();
+        }
+    }
 
-        /* Envelope */
-        psg->env_count += incr;
+    /**
+     * Whether the output is a constant until the next register write: no edge of the tones, the noise or the
+     * envelope can change ch_out, and the output has settled. The Event engine only advances the counters meanwhile.
+     */
+    bool isIdle()
+    {
+        return Engine::Event == engine && !dirty && UINT32_MAX == next_event() && (psg.out + mix_output()) >> 1 == psg.out;
+    }
 
-        if (psg->env_count >= psg->env_freq) {
-            if (!psg->env_pause) {
-                if (psg->env_face)
-                    psg->env_ptr = (psg->env_ptr + 1) & 0x3f;
-                else
-                    psg->env_ptr = (psg->env_ptr + 0x3f) & 0x3f;
+  private:
+    // the ticks of update_output in the samples (advances psgtime)
+    uint64_t count_ticks(int samples)
+    {
+        uint32_t realstep = psg.realstep;
+        uint32_t psgstep = psg.psgstep;
+        uint32_t psgtime = psg.psgtime;
+        uint64_t ticks = 0;
+        for (int i = 0; i < samples; i++) {
+            if (realstep > psgtime) {
+                uint32_t n = (realstep - psgtime + psgstep - 1) / psgstep;
+                psgtime += n * psgstep;
+                ticks += n;
+            }
+            psgtime -= realstep;
+        }
+        psg.psgtime = psgtime;
+        return ticks;
+    }
+
+    // The ticks of update_output in the next sample without counting them one by one:
+    // psgtime stays below psgstep, so they are realstep / psgstep (minTicks) or one more
+    static inline uint32_t next_ticks(uint32_t* psgtime, uint32_t realstep, uint32_t psgstep, uint32_t minTicks)
+    {
+        uint32_t time = *psgtime + minTicks * psgstep;
+        uint32_t ticks = minTicks;
+        if (realstep > time) {
+            time += psgstep;
+            ticks++;
+        }
+        *psgtime = time - realstep;
+        return ticks;
+    }
+
+    // run_ticks for the ticks of count_ticks
+    inline void run_long_ticks(uint64_t ticks)
+    {
+        while (ticks) {
+            uint32_t n = ticks < 0x10000000 ? (uint32_t)ticks : 0x10000000;
+            run_ticks(n);
+            ticks -= n;
+        }
+    }
+
+    void calcBlockEvent(int16_t* buf, int samples)
+    {
+        if (isIdle()) {
+            // only the counters advance as skip does, and every sample is the settled output
+            run_long_ticks(count_ticks(samples));
+            for (int i = 0; i < samples; i++) {
+                buf[i] = (int16_t)psg.out;
+            }
+            return;
+        }
+        uint32_t realstep = psg.realstep;
+        uint32_t psgstep = psg.psgstep;
+        uint32_t psgtime = psg.psgtime;
+        uint32_t minTicks = realstep / psgstep;
+        for (int i = 0; i < samples; i++) {
+            run_ticks(next_ticks(&psgtime, realstep, psgstep, minTicks));
+            buf[i] = (int16_t)psg.out;
+        }
+        psg.psgtime = psgtime;
+    }
+
+    // Render with the Tick engine, or the Event engine for the others, with the outputs of the Output
+    template <int Output>
+    void calcBlockTicks(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        if (Engine::Tick == engine) {
+            dirty = true;
+        } else if (Engine::Event != engine) {
+            flush_ticks(); // the events of Blep and Fir do not skip the muted channels
+        }
+        uint32_t realstep = psg.realstep;
+        uint32_t psgstep = psg.psgstep;
+        uint32_t psgtime = psg.psgtime;
+        uint32_t minTicks = realstep / psgstep;
+        for (int i = 0; i < samples; i++) {
+            run_sample_ticks<Output>(next_ticks(&psgtime, realstep, psgstep, minTicks));
+            put_sample<Output>(buf, stems, i);
+        }
+        psg.psgtime = psgtime;
+    }
+
+    // Write the sample i: out to buf, or side_out interleaved to buf (OutputStereo), and stem_out (OutputStems)
+    template <int Output>
+    inline void put_sample(int16_t* buf, int16_t* const* stems, int i)
+    {
+        if (OutputStereo == Output) {
+            buf[i * 2] = (int16_t)psg.side_out[0];
+            buf[i * 2 + 1] = (int16_t)psg.side_out[1];
+        } else {
+            buf[i] = (int16_t)psg.out;
+            if (OutputStems == Output) {
+                for (int ch = 0; ch < 3; ch++) {
+                    if (stems[ch]) {
+                        stems[ch][i] = (int16_t)psg.stem_out[ch];
+                    }
+                }
+            }
+        }
+    }
+
+    // Run the ticks of a sample with the Tick engine, or the Event engine for the others
+    template <int Output>
+    inline void run_sample_ticks(uint32_t ticks)
+    {
+        if (Engine::Tick == engine) {
+            while (ticks--) {
+                update_output();
+                psg.out += mix_output();
+                psg.out >>= 1;
+                update_extra<Output>();
+            }
+        } else {
+            run_ticks<Output>(ticks);
+        }
+    }
+
+    // Run the ticks with the Event engine
+    template <int Output = OutputMono>
+    inline void run_ticks(uint32_t ticks)
+    {
+        while (ticks) {
+            if (!dirty && ticks < event_ticks) {
+                // no edge changes the output in the ticks
+                pending_ticks += ticks;
+                event_ticks -= ticks;
+                skip_output<Output>(ticks);
+                break;
+            }
+            if (!dirty) {
+                pending_ticks += event_ticks - 1;
+                skip_output<Output>(event_ticks - 1);
+                ticks -= event_ticks - 1;
+            }
+            flush_ticks();
+            update_output();
+            psg.out += mix_output();
+            psg.out >>= 1;
+            update_extra<Output>();
+            ticks--;
+            dirty = false;
+            event_ticks = next_event();
+        }
+        if (0x40000000 <= pending_ticks) {
+            flush_ticks(); // keep the pending ticks far from the overflow while the output does not change
+        }
+    }
+
+    template <int Output = OutputMono>
+    void calcBlockBlep(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        const float* residual = blep_table().residual;
+        int32_t level[BlepTracks];
+        const int tracks = track_levels<Output>(level);
+        if (blep_output != Output) {
+            // the tracks of the Output start from the current levels
+            for (int k = 1; k < tracks; k++) {
+                memset(blep_ring[k], 0, sizeof(blep_ring[k]));
+                blep_level[k] = level[k];
+            }
+            blep_output = Output;
+        }
+        uint32_t realstep = psg.realstep;
+        uint32_t psgstep = psg.psgstep;
+        uint32_t psgtime = psg.psgtime;
+        uint32_t minTicks = realstep / psgstep;
+        for (int i = 0; i < samples; i++) {
+            uint32_t start = psgtime;
+            uint32_t ticks = next_ticks(&psgtime, realstep, psgstep, minTicks);
+            uint32_t tick = 0;
+            while (tick < ticks) {
+                if (!dirty && ticks - tick < event_ticks) {
+                    pending_ticks += ticks - tick;
+                    event_ticks -= ticks - tick;
+                    break;
+                }
+                if (!dirty) {
+                    pending_ticks += event_ticks - 1;
+                    tick += event_ticks - 1;
+                }
+                flush_ticks();
+                update_band_limited();
+                track_levels<Output>(level);
+                for (int k = 0; k < tracks; k++) {
+                    if (level[k] != blep_level[k]) {
+                        // the step occurs at the tick, and the sample is taken at the end of the ticks of this sample
+                        float delta = (float)(level[k] - blep_level[k]);
+                        float position = (float)(realstep - (start + tick * psgstep)) * BlepOversampling / realstep;
+                        int index = (int)position;
+                        float fraction = position - index;
+                        for (int n = 0; n < BlepLength; n++, index += BlepOversampling) {
+                            float r = residual[index] + (residual[index + 1] - residual[index]) * fraction;
+                            blep_ring[k][(blep_pos + n) & (BlepRing - 1)] += delta * r;
+                        }
+                        blep_level[k] = level[k];
+                    }
+                }
+                tick++;
+                dirty = false;
+                event_ticks = next_event();
+            }
+            int32_t out[BlepTracks];
+            for (int k = 0; k < tracks; k++) {
+                out[k] = Decimator::clamp((float)blep_level[k] + blep_ring[k][blep_pos]);
+                blep_ring[k][blep_pos] = 0;
+            }
+            blep_pos = (blep_pos + 1) & (BlepRing - 1);
+            psg.out = out[0];
+            put_tracks<Output>(buf, stems, i, out);
+        }
+        psg.psgtime = psgtime;
+    }
+
+    template <int Output = OutputMono>
+    void calcBlockFir(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        uint32_t realstep = psg.realstep;
+        uint32_t psgstep = psg.psgstep;
+        uint32_t psgtime = psg.psgtime;
+        int32_t level[BlepTracks];
+        const int tracks = track_levels<Output>(level);
+        Decimator* track[BlepTracks] = {&fir, &fir_extra[0], &fir_extra[1], &fir_extra[2]};
+        for (int k = 0; k < tracks; k++) {
+            if (!track[k]->prepare(realstep, psgstep)) {
+                fir_output = OutputMono;
+                calcBlockTicks<Output>(buf, stems, samples); // no memory for the decimator
+                return;
+            }
+        }
+        if (fir_output != Output) {
+            // the decimators of the Output start from the current levels
+            for (int k = 1; k < tracks; k++) {
+                track[k]->clear((float)level[k]);
+            }
+            fir_output = Output;
+        }
+        uint32_t minTicks = realstep / psgstep;
+        for (int i = 0; i < samples; i++) {
+            uint32_t ticks = next_ticks(&psgtime, realstep, psgstep, minTicks);
+            uint32_t tick = 0;
+            while (tick < ticks) {
+                if (!dirty && ticks - tick < event_ticks) {
+                    pending_ticks += ticks - tick;
+                    event_ticks -= ticks - tick;
+                    for (int k = 0; k < tracks; k++) {
+                        track[k]->fill((float)level[k], ticks - tick);
+                    }
+                    break;
+                }
+                if (!dirty) {
+                    pending_ticks += event_ticks - 1;
+                    for (int k = 0; k < tracks; k++) {
+                        track[k]->fill((float)level[k], event_ticks - 1);
+                    }
+                    tick += event_ticks - 1;
+                }
+                flush_ticks();
+                update_band_limited();
+                track_levels<Output>(level);
+                for (int k = 0; k < tracks; k++) {
+                    track[k]->push((float)level[k]);
+                }
+                tick++;
+                dirty = false;
+                event_ticks = next_event();
+            }
+            int32_t out[BlepTracks];
+            for (int k = 0; k < tracks; k++) {
+                out[k] = Decimator::clamp(track[k]->output(psgtime));
+            }
+            psg.out = out[0];
+            put_tracks<Output>(buf, stems, i, out);
+        }
+        psg.psgtime = psgtime;
+    }
+
+    // The levels of the tracks of the Output from ch_out (out, then the sides or the channels), and the tracks
+    template <int Output>
+    inline int track_levels(int32_t* level)
+    {
+        level[0] = psg.ch_out[0] + psg.ch_out[1] + psg.ch_out[2];
+        if (OutputStereo == Output) {
+            level[1] = mix_side(0);
+            level[2] = mix_side(1);
+            return 3;
+        } else if (OutputStems == Output) {
+            for (int ch = 0; ch < 3; ch++) {
+                level[1 + ch] = psg.ch_out[ch];
+            }
+            return 4;
+        }
+        return 1;
+    }
+
+    // Write the sample i of the tracks of the band-limited engines (out is in psg.out)
+    template <int Output>
+    inline void put_tracks(int16_t* buf, int16_t* const* stems, int i, const int32_t* out)
+    {
+        if (OutputStereo == Output) {
+            psg.side_out[0] = out[1];
+            psg.side_out[1] = out[2];
+        } else if (OutputStems == Output) {
+            for (int ch = 0; ch < 3; ch++) {
+                psg.stem_out[ch] = out[1 + ch];
+            }
+        }
+        put_sample<Output>(buf, stems, i);
+    }
+
+    // update_output of the band-limited engines (without the mute by freq_limit), and return the sum of ch_out
+    inline int32_t update_band_limited()
+    {
+        int noise = update_counters();
+        int32_t level = 0;
+        for (int ch = 0; ch < 3; ch++) {
+            if (psg.mask & PSG_MASK_CH(ch)) {
+                psg.ch_out[ch] = 0;
+            } else if ((psg.tmask[ch] || psg.edge[ch]) && (psg.nmask[ch] || noise)) {
+                psg.ch_out[ch] = (int16_t)(psg.voltbl[(psg.volume[ch] & 32) ? psg.env_ptr : psg.volume[ch] & 31] << 4);
+            } else {
+                psg.ch_out[ch] = 0;
+            }
+            level += psg.ch_out[ch];
+        }
+        return level;
+    }
+
+    void fir_clear()
+    {
+        if (Engine::Fir == engine) {
+            fir.prepare(psg.realstep, psg.psgstep);
+            fir.clear((float)mix_output());
+        }
+        fir_output = OutputMono;
+    }
+
+    void blep_clear()
+    {
+        memset(blep_ring, 0, sizeof(blep_ring));
+        blep_pos = 0;
+        blep_level[0] = psg.ch_out[0] + psg.ch_out[1] + psg.ch_out[2];
+        blep_output = OutputMono;
+    }
+
+    static const BlepTable& blep_table()
+    {
+        static const BlepTable table;
+        return table;
+    }
+
+    static const NoiseJump& noise_jump()
+    {
+        static const NoiseJump table;
+        return table;
+    }
+
+    // Advance a counter of update_output by n ticks, and return how many times it reached the frequency
+    static inline uint32_t skip_counter(uint32_t& count, uint32_t freq, uint32_t n)
+    {
+        uint32_t edges = 0;
+        while (n && freq <= count + 1) {
+            if (freq <= 1) {
+                // reaches the frequency at every tick
+                count = freq ? count : 0;
+                return edges + n;
+            }
+            count = count + 1 - freq;
+            edges++;
+            n--;
+        }
+        if (!n) {
+            return edges;
+        }
+        if (n < freq - count) {
+            count += n;
+            return edges;
+        }
+        n -= freq - count;
+        count = n % freq;
+        return edges + 1 + n / freq;
+    }
+
+    static inline uint32_t ticks_to_edge(uint32_t count, uint32_t freq)
+    {
+        return freq <= count + 1 ? 1 : freq - count;
+    }
+
+    // Apply the pending ticks to the counters (no edges in them change the output)
+    void flush_ticks()
+    {
+        uint32_t n = pending_ticks;
+        dirty = true;
+        if (!n) {
+            return;
+        }
+        pending_ticks = 0;
+
+        uint32_t count = psg.env_count;
+        skip_counter(count, psg.env_freq, n); // the envelope is paused, or does not reach the next step
+        psg.env_count = count;
+
+        count = psg.noise_count;
+        uint32_t edges = skip_counter(count, psg.noise_freq, n);
+        psg.noise_count = (uint8_t)count;
+        uint32_t shifts = psg.noise_scaler ? edges / 2 : (edges + 1) / 2;
+        psg.noise_scaler ^= edges & 1;
+        if (shifts) {
+            psg.noise_seed = noise_jump().shift(psg.noise_seed, shifts);
+        }
+
+        for (int i = 0; i < 3; i++) {
+            count = psg.count[i];
+            edges = skip_counter(count, psg.freq[i], n);
+            psg.count[i] = (uint16_t)count;
+            psg.edge[i] ^= edges & 1;
+        }
+    }
+
+    // Ticks until the next edge that can change the output of update_output
+    uint32_t next_event()
+    {
+        uint32_t result = UINT32_MAX;
+        bool noise = false;
+        if (!psg.env_pause) {
+            result = ticks_to_edge(psg.env_count, psg.env_freq);
+        }
+        for (int i = 0; i < 3; i++) {
+            if (Engine::Blep != engine && Engine::Fir != engine && 0 < psg.freq_limit && psg.freq[i] <= psg.freq_limit && psg.nmask[i]) {
+                continue; // muted (ch_out is not updated)
+            }
+            if (psg.mask & PSG_MASK_CH(i)) {
+                continue;
+            }
+            uint32_t volume = (psg.volume[i] & 32) ? psg.voltbl[psg.env_ptr] : psg.voltbl[psg.volume[i] & 31];
+            if (!volume) {
+                continue; // silent until the volume register or the envelope changes
+            }
+            if (!psg.tmask[i]) {
+                uint32_t ticks = ticks_to_edge(psg.count[i], psg.freq[i]);
+                result = ticks < result ? ticks : result;
+            }
+            noise |= !psg.nmask[i];
+        }
+        if (noise) {
+            uint32_t ticks = ticks_to_edge(psg.noise_count, psg.noise_freq);
+            result = ticks < result ? ticks : result;
+        }
+        return result;
+    }
+
+    // The output converges in a few ticks while ch_out does not change
+    template <int Output = OutputMono>
+    inline void skip_output(uint32_t n)
+    {
+        int32_t mix = mix_output();
+        while (n--) {
+            int32_t out = (psg.out + mix) >> 1;
+            bool settled = out == psg.out;
+            psg.out = out;
+            if (OutputMono != Output) {
+                settled &= update_extra<Output>();
+            }
+            if (settled) {
+                break;
+            }
+        }
+    }
+
+    inline int32_t mix_side(int side)
+    {
+        return (psg.ch_out[0] * side_gain[0][side] + psg.ch_out[1] * side_gain[1][side] + psg.ch_out[2] * side_gain[2][side]) >> 8;
+    }
+
+    // Update side_out or stem_out by a tick as out, and return whether they did not change
+    template <int Output>
+    inline bool update_extra()
+    {
+        bool settled = true;
+        if (OutputStereo == Output) {
+            for (int side = 0; side < 2; side++) {
+                int32_t v = (psg.side_out[side] + mix_side(side)) >> 1;
+                settled &= v == psg.side_out[side];
+                psg.side_out[side] = v;
+            }
+        } else if (OutputStems == Output) {
+            for (int ch = 0; ch < 3; ch++) {
+                int32_t v = (psg.stem_out[ch] + psg.ch_out[ch]) >> 1;
+                settled &= v == psg.stem_out[ch];
+                psg.stem_out[ch] = v;
+            }
+        }
+        return settled;
+    }
+
+    void update_pan()
+    {
+        bool was = panned;
+        panned = false;
+        for (int i = 0; i < 3; i++) {
+            for (int side = 0; side < 2; side++) {
+                side_gain[i][side] = (psg.stereo_mask & (1 << (i * 2 + side))) ? pan[i][side] : 0;
+                panned |= 256 != side_gain[i][side];
+            }
+        }
+        if (panned && !was) {
+            // the sides start from the mono output
+            psg.side_out[0] = psg.out;
+            psg.side_out[1] = psg.out;
+        }
+    }
+
+    void internal_refresh()
+    {
+        uint32_t f_master = psg.clk;
+
+        flush_ticks();
+        if (psg.clk_div) {
+            f_master /= 2;
+        }
+
+        psg.base_incr = 1 << GETA_BITS;
+        psg.realstep = f_master;
+        psg.psgstep = psg.rate * 8;
+        psg.psgtime = 0;
+        psg.freq_limit = (uint32_t)(f_master / 16 / (psg.rate / 2));
+    }
+    // advance the envelope, noise and tone counters by a tick, and return the noise output
+    inline int update_counters()
+    {
+        int i;
+        uint8_t incr;
+
+        psg.base_count += psg.base_incr;
+        incr = (psg.base_count >> GETA_BITS);
+        psg.base_count &= (1 << GETA_BITS) - 1;
+
+        /* Envelope */
+        psg.env_count += incr;
+
+        if (psg.env_count >= psg.env_freq) {
+            if (!psg.env_pause) {
+                if (psg.env_face)
+                    psg.env_ptr = (psg.env_ptr + 1) & 0x3f;
+                else
+                    psg.env_ptr = (psg.env_ptr + 0x3f) & 0x3f;
             }
 
-            if (psg->env_ptr & 0x20) /* if carry or borrow */
+            if (psg.env_ptr & 0x20) /* if carry or borrow */
             {
-                if (psg->env_continue) {
-                    if (psg->env_alternate ^ psg->env_hold)
-                        psg->env_face ^= 1;
-                    if (psg->env_hold)
-                        psg->env_pause = 1;
-                    psg->env_ptr = psg->env_face ? 0 : 0x1f;
+                if (psg.env_continue) {
+                    if (psg.env_alternate ^ psg.env_hold)
+                        psg.env_face ^= 1;
+                    if (psg.env_hold)
+                        psg.env_pause = 1;
+                    psg.env_ptr = psg.env_face ? 0 : 0x1f;
                 } else {
-                    psg->env_pause = 1;
-                    psg->env_ptr = 0;
+                    psg.env_pause = 1;
+                    psg.env_ptr = 0;
                 }
             }
 
-            if (psg->env_freq >= incr)
-                psg->env_count -= psg->env_freq;
+            if (psg.env_freq >= incr)
+                psg.env_count -= psg.env_freq;
             else
-                psg->env_count = 0;
+                psg.env_count = 0;
         }
 
         /* Noise */
-        psg->noise_count += incr;
-        if (psg->noise_count >= psg->noise_freq) {
-            psg->noise_scaler ^= 1;
-            if (psg->noise_scaler) {
-                if (psg->noise_seed & 1)
-                    psg->noise_seed ^= 0x24000;
-                psg->noise_seed >>= 1;
+        psg.noise_count += incr;
+        if (psg.noise_count >= psg.noise_freq) {
+            psg.noise_scaler ^= 1;
+            if (psg.noise_scaler) {
+                if (psg.noise_seed & 1)
+                    psg.noise_seed ^= 0x24000;
+                psg.noise_seed >>= 1;
             }
 
-            if (psg->noise_freq >= incr)
-                psg->noise_count -= psg->noise_freq;
+            if (psg.noise_freq >= incr)
+                psg.noise_count -= psg.noise_freq;
             else
-                psg->noise_count = 0;
+                psg.noise_count = 0;
         }
-        noise = psg->noise_seed & 1;
 
         /* Tone */
         for (i = 0; i < 3; i++) {
-            psg->count[i] += incr;
-            if (psg->count[i] >= psg->freq[i]) {
-                psg->edge[i] = !psg->edge[i];
+            psg.count[i] += incr;
+            if (psg.count[i] >= psg.freq[i]) {
+                psg.edge[i] = !psg.edge[i];
 
-                if (psg->freq[i] >= incr)
-                    psg->count[i] -= psg->freq[i];
+                if (psg.freq[i] >= incr)
+                    psg.count[i] -= psg.freq[i];
                 else
-                    psg->count[i] = 0;
+                    psg.count[i] = 0;
             }
+        }
+        return psg.noise_seed & 1;
+    }
+
+    inline void update_output()
+    {
+        int i;
+        int noise = update_counters();
 
-            if (0 < psg->freq_limit && psg->freq[i] <= psg->freq_limit && psg->nmask[i]) {
+        for (i = 0; i < 3; i++) {
+            if (0 < psg.freq_limit && psg.freq[i] <= psg.freq_limit && psg.nmask[i]) {
                 /* Mute the channel if the pitch is higher than the Nyquist frequency at the current sample rate,
                  * to prevent aliased or broken tones from being generated. Of course, this logic doesn't exist
                  * on the actual chip, but practically all tones higher than the Nyquist frequency are usually
@@ -398,28 +1620,113 @@ class EMU2149
                 continue;
             }
 
-            if (psg->mask & PSG_MASK_CH(i)) {
-                psg->ch_out[i] = 0;
+            if (psg.mask & PSG_MASK_CH(i)) {
+                psg.ch_out[i] = 0;
                 continue;
             }
 
-            if ((psg->tmask[i] || psg->edge[i]) && (psg->nmask[i] || noise)) {
-                if (!(psg->volume[i] & 32))
-                    psg->ch_out[i] = (psg->voltbl[psg->volume[i] & 31] << 4);
+            if ((psg.tmask[i] || psg.edge[i]) && (psg.nmask[i] || noise)) {
+                if (!(psg.volume[i] & 32))
+                    psg.ch_out[i] = (psg.voltbl[psg.volume[i] & 31] << 4);
                 else
-                    psg->ch_out[i] = (psg->voltbl[psg->env_ptr] << 4);
+                    psg.ch_out[i] = (psg.voltbl[psg.env_ptr] << 4);
             } else {
-                psg->ch_out[i] = 0;
+                psg.ch_out[i] = 0;
             }
         }
     }
 
     inline int16_t mix_output()
     {
-        return (int16_t)(psg->ch_out[0] + psg->ch_out[1] + psg->ch_out[2]);
+        return (int16_t)(psg.ch_out[0] + psg.ch_out[1] + psg.ch_out[2]);
     }
 };
 
+// Builds the minBLEP table as described in "Hard Sync Without Aliasing" (Eli Brandt, 2001):
+// a windowed sinc is converted to minimum phase through the real cepstrum, then integrated.
+inline EMU2149::BlepTable::BlepTable()
+{
+    const double pi = 3.14159265358979323846;
+    const int n = 4096;
+    const int taps = BlepLength * BlepOversampling + 1;
+    double* re = new double[n];
+    double* im = new double[n];
+    auto fft = [n, pi](double* re, double* im, bool inverse) {
+        for (int i = 1, j = 0; i < n; i++) {
+            int bit = n >> 1;
+            for (; j & bit; bit >>= 1) j ^= bit;
+            j ^= bit;
+            if (i < j) {
+                double t = re[i];
+                re[i] = re[j], re[j] = t;
+                t = im[i];
+                im[i] = im[j], im[j] = t;
+            }
+        }
+        for (int len = 2; len <= n; len <<= 1) {
+            double angle = (inverse ? 2 : -2) * pi / len;
+            for (int i = 0; i < n; i += len) {
+                for (int k = 0; k < len / 2; k++) {
+                    double wr = cos(angle * k), wi = sin(angle * k);
+                    double* ur = &re[i + k];
+                    double* ui = &im[i + k];
+                    double vr = re[i + k + len / 2] * wr - im[i + k + len / 2] * wi;
+                    double vi = re[i + k + len / 2] * wi + im[i + k + len / 2] * wr;
+                    re[i + k + len / 2] = *ur - vr, im[i + k + len / 2] = *ui - vi;
+                    *ur += vr, *ui += vi;
+                }
+            }
+        }
+        if (inverse) {
+            for (int i = 0; i < n; i++) re[i] /= n, im[i] /= n;
+        }
+    };
+
+    // Blackman windowed sinc
+    for (int i = 0; i < n; i++) {
+        re[i] = im[i] = 0;
+        if (i < taps) {
+            double x = (double)(i - taps / 2) / BlepOversampling;
+            double sinc = x == 0 ? 1 : sin(pi * x) / (pi * x);
+            double w = 0.42 - 0.5 * cos(2 * pi * i / (taps - 1)) + 0.08 * cos(4 * pi * i / (taps - 1));
+            re[i] = sinc * w;
+        }
+    }
+
+    // real cepstrum
+    fft(re, im, false);
+    for (int i = 0; i < n; i++) {
+        re[i] = log(sqrt(re[i] * re[i] + im[i] * im[i]) + 1e-30);
+        im[i] = 0;
+    }
+    fft(re, im, true);
+
+    // fold to the minimum phase, and return to the time domain
+    for (int i = 1; i < n / 2; i++) {
+        re[i] *= 2, im[i] *= 2;
+    }
+    for (int i = n / 2 + 1; i < n; i++) {
+        re[i] = im[i] = 0;
+    }
+    fft(re, im, false);
+    for (int i = 0; i < n; i++) {
+        double m = exp(re[i]);
+        re[i] = m * cos(im[i]);
+        im[i] = m * sin(im[i]);
+    }
+    fft(re, im, true);
+
+    // integrate to the step, and normalize its final value to 1
+    double sum = 0, total = 0;
+    for (int i = 0; i < taps; i++) total += re[i];
+    for (int i = 0; i < BlepLength * BlepOversampling + 2; i++) {
+        if (i < taps) sum += re[i];
+        residual[i] = i < BlepLength * BlepOversampling ? (float)(sum / total - 1) : 0;
+    }
+    delete[] re;
+    delete[] im;
+}
+
 class EMU2212
 {
   public:
@@ -428,17 +1735,23 @@ class EMU2212
         Enhanced,
     };
 
+    enum class Engine {
+        Scalar, // reference implementation
+        Simd,     // bit-exact with Scalar, the channels are processed in SIMD lanes (falls back to Scalar if unsupported)
+        Analytic, // advances the channels by a whole sample, and averages the waveform over the covered phases (box filter)
+        Mipmap,   // advances the channels by a whole sample, and reads a band-limited copy of the waveform with linear interpolation
+        Fir,      // decimates the sum of the levels at every tick with the polyphase FIR of Decimator
+    };
+
   private:
     inline int SCC_MASK_CH(int x) { return (1 << (x)); }
-    const int GETA_BITS = 22;
+    static const int GETA_BITS = 22;
 
+  public:
     typedef struct {
-        uint32_t clk, rate, base_incr;
+        // hot: read or updated by the ticks
         int16_t out;
-        Type type;
-        uint32_t mode;
-        uint32_t active;
-        uint32_t base_adr;
+        uint32_t base_incr;
         uint32_t mask;
 
         uint32_t realstep;
@@ -446,15 +1759,10 @@ class EMU2212
         uint32_t sccstep;
 
         uint32_t incr[5];
-
-        int8_t wave[5][32];
-
         uint32_t count[5];
-        uint32_t freq[5];
         uint32_t phase[5];
         uint32_t volume[5];
         uint32_t offset[5];
-        uint8_t reg[0x100 - 0xC0];
 
         int ch_enable;
         int ch_enable_next;
@@ -465,29 +1773,129 @@ class EMU2212
         int rotate[5];
 
         int16_t ch_out[5];
+        int8_t wave[5][32];
+
+        // cold: registers and settings
+        uint32_t clk, rate;
+        Type type;
+        uint32_t mode;
+        uint32_t active;
+        uint32_t base_adr;
+        uint32_t freq[5];
+        uint8_t reg[0x100 - 0xC0];
     } Context;
 
-    Context* scc;
+    /**
+     * Emulation state of saveState: fixed-width fields without padding, so that it does not depend on Context
+     * or the compiler. The settings (clock, rate and engine) are not included.
+     */
+    struct State {
+        uint32_t scctime;
+        uint32_t mask;
+        uint32_t incr[5];
+        uint32_t count[5];
+        uint32_t phase[5];
+        uint32_t volume[5];
+        uint32_t offset[5];
+        uint32_t freq[5];
+        int32_t rotate[5];
+        int32_t ch_enable;
+        int32_t ch_enable_next;
+        uint32_t base_adr;
+        int16_t out;
+        int16_t ch_out[5];
+        int8_t wave[5][32];
+        uint8_t reg[0x100 - 0xC0];
+        uint8_t type; // Type
+        uint8_t mode;
+        uint8_t active;
+        uint8_t cycle_4bit;
+        uint8_t cycle_8bit;
+        uint8_t refresh;
+        uint8_t reserved[2];
+    };
+    static_assert(sizeof(State) == 404, "EMU2212::State must not have padding");
+
+  private:
+    alignas(64) Context scc;
+    Engine engine;
+    int32_t level[5][32];     // (volume * wave) & 0xfff0 of each phase (Analytic, and the gather of Simd)
+    int32_t level_sum[5][33]; // prefix sums of level (Analytic)
+    uint32_t level_dirty;     // channels whose level must be rebuilt (Analytic)
+
+    enum {
+        MipmapLevels = 6, // up to 16, 8, 4, 2, 1 and 0 harmonics (DC only)
+    };
+    float mipmap[5][MipmapLevels][32]; // band-limited copies of wave (Mipmap)
+    uint32_t mipmap_dirty;             // channels whose mipmap must be rebuilt (Mipmap)
+
+    enum {
+        FirBlock = 64, // samples of the ticks written to the decimator at once (Fir)
+    };
+    Decimator fir;
+    Decimator fir_extra[5]; // the left and right (OutputStereo), or the channels (OutputStems)
+    int fir_output;         // Output whose decimators follow the ticks
+
+    // outputs of the engines
+    enum Output {
+        OutputMono,   // out
+        OutputStereo, // the left and right instead of out (interleaved)
+        OutputStems,  // each channel as well
+    };
+
+    int32_t pan[5][2]; // gains of the channels to the left and right (256: 1.0)
+    bool panned;       // pan is not 256 for all
 
   public:
     EMU2212(uint32_t c, uint32_t r)
     {
-        scc = new Context();
-        scc->clk = c;
-        scc->rate = r ? r : 44100;
+        memset(&scc, 0, sizeof(scc));
+        engine = Engine::Scalar;
+        for (int i = 0; i < 5; i++) {
+            pan[i][0] = 256;
+            pan[i][1] = 256;
+        }
+        panned = false;
+        fir_output = OutputMono;
+        level_dirty = 0x1F;
+        mipmap_dirty = 0x1F;
+        scc.clk = c;
+        scc.rate = r ? r : 44100;
         internal_refresh();
-        scc->type = Type::Enhanced;
+        scc.type = Type::Enhanced;
+        setEngine(Engine::Simd);
     }
 
-    ~EMU2212()
+    static bool isSimdSupported() { return Decimator::isSimdSupported(); }
+
+    void setEngine(Engine engine)
+    {
+        if (Engine::Simd == engine && !isSimdSupported()) {
+            engine = Engine::Scalar;
+        }
+        Engine previous = this->engine;
+        this->engine = engine;
+        if (Engine::Fir == engine && Engine::Fir != previous) {
+            fir_clear();
+        }
+    }
+
+    // Quality of Engine::Fir
+    void setFirQuality(Decimator::Quality quality)
     {
-        delete scc;
+        fir.setQuality(quality);
+        for (int i = 0; i < 5; i++) {
+            fir_extra[i].setQuality(quality);
+        }
+        fir_clear();
     }
 
+    Engine getEngine() { return engine; }
+
     uint32_t getFrequency(int ch)
     {
-        if (0 <= ch && ch < 6) {
-            return 0 < scc->volume[ch] ? scc->freq[ch] : 0;
+        if (0 <= ch && ch < 5) {
+            return 0 < scc.volume[ch] ? scc.freq[ch] : 0;
         } else {
             return 0;
         }
@@ -497,95 +1905,198 @@ class EMU2212
     {
         int i, j;
 
-        if (scc == NULL)
-            return;
-
-        scc->mode = 0;
-        scc->active = 0;
-        scc->base_adr = 0x9000;
+        scc.mode = 0;
+        scc.active = 0;
+        scc.base_adr = 0x9000;
 
         for (i = 0; i < 5; i++) {
-            for (j = 0; j < 5; j++)
-                scc->wave[i][j] = 0;
-            scc->count[i] = 0;
-            scc->freq[i] = 0;
-            scc->phase[i] = 0;
-            scc->volume[i] = 0;
-            scc->offset[i] = 0;
-            scc->rotate[i] = 0;
-            scc->ch_out[i] = 0;
+            for (j = 0; j < 32; j++)
+                scc.wave[i][j] = 0;
+            scc.incr[i] = 0;
+            scc.count[i] = 0;
+            scc.freq[i] = 0;
+            scc.phase[i] = 0;
+            scc.volume[i] = 0;
+            scc.offset[i] = 0;
+            scc.rotate[i] = 0;
+            scc.ch_out[i] = 0;
         }
 
-        memset(scc->reg, 0, 0x100 - 0xC0);
+        memset(scc.reg, 0, 0x100 - 0xC0);
 
-        scc->mask = 0;
+        scc.mask = 0;
 
-        scc->ch_enable = 0xff;
-        scc->ch_enable_next = 0xff;
+        scc.ch_enable = 0xff;
+        scc.ch_enable_next = 0xff;
 
-        scc->cycle_4bit = 0;
-        scc->cycle_8bit = 0;
-        scc->refresh = 0;
+        scc.cycle_4bit = 0;
+        scc.cycle_8bit = 0;
+        scc.refresh = 0;
 
-        scc->out = 0;
+        scc.scctime = 0;
+        scc.out = 0;
+        level_dirty = 0x1F;
+        mipmap_dirty = 0x1F;
+        fir_clear();
 
         return;
     }
 
-    void set_rate(uint32_t r)
+    void saveContext(Context* ctx) { memcpy(ctx, &scc, sizeof(Context)); }
+    void loadContext(const Context* ctx)
     {
-        scc->rate = r ? r : 44100;
-        internal_refresh();
+        memcpy(&scc, ctx, sizeof(Context));
+        level_dirty = 0x1F;
+        mipmap_dirty = 0x1F;
+        fir_clear();
     }
 
-    void set_type(Type type)
+    void saveState(State* state)
     {
-        scc->type = type;
+        memset(state, 0, sizeof(State));
+        state->scctime = scc.scctime;
+        state->mask = scc.mask;
+        for (int i = 0; i < 5; i++) {
+            state->incr[i] = scc.incr[i];
+            state->count[i] = scc.count[i];
+            state->phase[i] = scc.phase[i];
+            state->volume[i] = scc.volume[i];
+            state->offset[i] = scc.offset[i];
+            state->freq[i] = scc.freq[i];
+            state->rotate[i] = scc.rotate[i];
+            state->ch_out[i] = scc.ch_out[i];
+        }
+        state->ch_enable = scc.ch_enable;
+        state->ch_enable_next = scc.ch_enable_next;
+        state->base_adr = scc.base_adr;
+        state->out = scc.out;
+        memcpy(state->wave, scc.wave, sizeof(state->wave));
+        memcpy(state->reg, scc.reg, sizeof(state->reg));
+        state->type = (uint8_t)scc.type;
+        state->mode = (uint8_t)scc.mode;
+        state->active = (uint8_t)scc.active;
+        state->cycle_4bit = (uint8_t)scc.cycle_4bit;
+        state->cycle_8bit = (uint8_t)scc.cycle_8bit;
+        state->refresh = (uint8_t)scc.refresh;
     }
 
-    int16_t calc()
+    // Whether the state can be loaded to this instance: the indexes, the counters and the timing are in range
+    bool verifyState(const State* state)
     {
-        while (scc->realstep > scc->scctime) {
-            scc->scctime += scc->sccstep;
-            update_output();
+        if (scc.sccstep <= state->scctime || 0xFF < (uint32_t)state->ch_enable || 0xFF < (uint32_t)state->ch_enable_next) {
+            return false;
+        }
+        for (int i = 0; i < 5; i++) {
+            if (scc.base_incr < state->incr[i] || ((1u << (GETA_BITS + 5)) - 1) < state->count[i]) {
+                return false;
+            }
+            if (31 < state->phase[i] || 31 < state->offset[i] || (0 != state->rotate[i] && 0x1F != state->rotate[i])) {
+                return false;
+            }
+            if (15 < state->volume[i] || 0xFFF < state->freq[i]) {
+                return false;
+            }
+        }
+        if ((uint8_t)Type::Enhanced < state->type || (0x9000 != state->base_adr && 0xB000 != state->base_adr)) {
+            return false;
+        }
+        return state->mode < 2 && state->active < 2 && !state->reserved[0] && !state->reserved[1];
+    }
+
+    /**
+     * Restore the state of saveState as loadContext does (the engine is kept).
+     * It returns false without any change if verifyState fails.
+     */
+    bool loadState(const State* state)
+    {
+        if (!verifyState(state)) {
+            return false;
         }
-        scc->scctime -= scc->realstep;
+        scc.scctime = state->scctime;
+        scc.mask = state->mask;
+        for (int i = 0; i < 5; i++) {
+            scc.incr[i] = state->incr[i];
+            scc.count[i] = state->count[i];
+            scc.phase[i] = state->phase[i];
+            scc.volume[i] = state->volume[i];
+            scc.offset[i] = state->offset[i];
+            scc.freq[i] = state->freq[i];
+            scc.rotate[i] = state->rotate[i];
+            scc.ch_out[i] = state->ch_out[i];
+        }
+        scc.ch_enable = state->ch_enable;
+        scc.ch_enable_next = state->ch_enable_next;
+        scc.base_adr = state->base_adr;
+        scc.out = state->out;
+        memcpy(scc.wave, state->wave, sizeof(scc.wave));
+        memcpy(scc.reg, state->reg, sizeof(scc.reg));
+        scc.type = (Type)state->type;
+        scc.mode = state->mode;
+        scc.active = state->active;
+        scc.cycle_4bit = state->cycle_4bit;
+        scc.cycle_8bit = state->cycle_8bit;
+        scc.refresh = state->refresh;
+        level_dirty = 0x1F;
+        mipmap_dirty = 0x1F;
+        fir_clear();
+        return true;
+    }
+
+    void set_rate(uint32_t r)
+    {
+        scc.rate = r ? r : 44100;
+        internal_refresh();
+    }
+
+    void set_type(Type type)
+    {
+        scc.type = type;
+    }
 
-        return mix_output();
+    int16_t calc()
+    {
+        int16_t result;
+        calcBlock(&result, 1);
+        return result;
+    }
+
+    void calcBlock(int16_t* buf, int samples)
+    {
+        render<OutputMono>(buf, NULL, samples);
     }
 
     void write(uint32_t adr, uint32_t val)
     {
         val = val & 0xFF;
 
-        if (scc->type == Type::Enhanced && (adr & 0xFFFE) == 0xBFFE) {
-            scc->base_adr = 0x9000 | ((val & 0x20) << 8);
+        if (scc.type == Type::Enhanced && (adr & 0xFFFE) == 0xBFFE) {
+            scc.base_adr = 0x9000 | ((val & 0x20) << 8);
             return;
         }
 
-        if (adr < scc->base_adr) return;
-        adr -= scc->base_adr;
+        if (adr < scc.base_adr) return;
+        adr -= scc.base_adr;
 
         if (adr == 0) {
             if (val == 0x3F) {
-                scc->mode = 0;
-                scc->active = 1;
-            } else if (val & 0x80 && scc->type == Type::Enhanced) {
-                scc->mode = 1;
-                scc->active = 1;
+                scc.mode = 0;
+                scc.active = 1;
+            } else if (val & 0x80 && scc.type == Type::Enhanced) {
+                scc.mode = 1;
+                scc.active = 1;
             } else {
-                scc->mode = 0;
-                scc->active = 0;
+                scc.mode = 0;
+                scc.active = 0;
             }
             return;
         }
 
-        if (!scc->active || adr < 0x800 || 0x8FF < adr) return;
+        if (!scc.active || adr < 0x800 || 0x8FF < adr) return;
 
-        if (scc->type == Type::Standard) {
+        if (scc.type == Type::Standard) {
             write_standard(adr, val);
         } else {
-            if (scc->mode)
+            if (scc.mode)
                 write_enhanced(adr, val);
             else
                 write_standard(adr, val);
@@ -601,85 +2112,129 @@ class EMU2212
 
         if (adr < 0xA0) {
             ch = (adr & 0xF0) >> 5;
-            if (!scc->rotate[ch]) {
-                scc->wave[ch][adr & 0x1F] = (int8_t)val;
-                if (scc->mode == 0 && ch == 3)
-                    scc->wave[4][adr & 0x1F] = (int8_t)val;
+            if (!scc.rotate[ch]) {
+                scc.wave[ch][adr & 0x1F] = (int8_t)val;
+                level_dirty |= 1 << ch;
+                mipmap_dirty |= 1 << ch;
+                if (scc.mode == 0 && ch == 3) {
+                    scc.wave[4][adr & 0x1F] = (int8_t)val;
+                    level_dirty |= 1 << 4;
+                    mipmap_dirty |= 1 << 4;
+                }
             }
         } else if (0xC0 <= adr && adr <= 0xC9) {
-            scc->reg[adr - 0xC0] = val;
+            scc.reg[adr - 0xC0] = val;
             ch = (adr & 0x0F) >> 1;
             if (adr & 1)
-                scc->freq[ch] = ((val & 0xF) << 8) | (scc->freq[ch] & 0xFF);
+                scc.freq[ch] = ((val & 0xF) << 8) | (scc.freq[ch] & 0xFF);
             else
-                scc->freq[ch] = (scc->freq[ch] & 0xF00) | (val & 0xFF);
+                scc.freq[ch] = (scc.freq[ch] & 0xF00) | (val & 0xFF);
 
-            if (scc->refresh)
-                scc->count[ch] = 0;
-            freq = scc->freq[ch];
-            if (scc->cycle_8bit)
+            if (scc.refresh)
+                scc.count[ch] = 0;
+            freq = scc.freq[ch];
+            if (scc.cycle_8bit)
                 freq &= 0xFF;
-            if (scc->cycle_4bit)
+            if (scc.cycle_4bit)
                 freq >>= 8;
             if (freq <= 8)
-                scc->incr[ch] = 0;
+                scc.incr[ch] = 0;
             else
-                scc->incr[ch] = scc->base_incr / (freq + 1);
+                scc.incr[ch] = scc.base_incr / (freq + 1);
         } else if (0xD0 <= adr && adr <= 0xD4) {
-            scc->reg[adr - 0xC0] = val;
-            scc->volume[adr & 0x0F] = (uint8_t)(val & 0xF);
+            scc.reg[adr - 0xC0] = val;
+            scc.volume[adr & 0x0F] = (uint8_t)(val & 0xF);
+            level_dirty |= 1 << (adr & 0x0F);
         } else if (adr == 0xE0) {
-            scc->reg[adr - 0xC0] = val;
-            scc->mode = (uint8_t)val & 1;
+            scc.reg[adr - 0xC0] = val;
+            scc.mode = (uint8_t)val & 1;
         } else if (adr == 0xE1) {
-            scc->reg[adr - 0xC0] = val;
-            scc->ch_enable_next = (uint8_t)val & 0x1F;
+            scc.reg[adr - 0xC0] = val;
+            scc.ch_enable_next = (uint8_t)val & 0x1F;
         } else if (adr == 0xE2) {
-            scc->reg[adr - 0xC0] = val;
-            scc->cycle_4bit = val & 1;
-            scc->cycle_8bit = val & 2;
-            scc->refresh = val & 32;
+            scc.reg[adr - 0xC0] = val;
+            scc.cycle_4bit = val & 1;
+            scc.cycle_8bit = val & 2;
+            scc.refresh = val & 32;
             if (val & 64)
                 for (ch = 0; ch < 5; ch++)
-                    scc->rotate[ch] = 0x1F;
+                    scc.rotate[ch] = 0x1F;
             else
                 for (ch = 0; ch < 5; ch++)
-                    scc->rotate[ch] = 0;
+                    scc.rotate[ch] = 0;
             if (val & 128)
-                scc->rotate[3] = scc->rotate[4] = 0x1F;
+                scc.rotate[3] = scc.rotate[4] = 0x1F;
         }
     }
 
     uint32_t read(uint32_t adr)
     {
-        if (scc->type == Type::Enhanced && (adr & 0xFFFE) == 0xBFFE)
-            return (scc->base_adr >> 8) & 0x20;
+        if (scc.type == Type::Enhanced && (adr & 0xFFFE) == 0xBFFE)
+            return (scc.base_adr >> 8) & 0x20;
 
-        if (adr < scc->base_adr) return 0;
-        adr -= scc->base_adr;
+        if (adr < scc.base_adr) return 0;
+        adr -= scc.base_adr;
 
         if (adr == 0) {
-            if (scc->mode)
+            if (scc.mode)
                 return 0x80;
             else
                 return 0x3F;
         }
-        if (!scc->active || adr < 0x800 || 0x8FF < adr) return 0;
-        return scc->type == Type::Standard || !scc->mode ? read_standard(adr) : read_enhanced(adr);
+        if (!scc.active || adr < 0x800 || 0x8FF < adr) return 0;
+        return scc.type == Type::Standard || !scc.mode ? read_standard(adr) : read_enhanced(adr);
     }
 
     uint32_t readReg(uint32_t adr)
     {
         if (adr < 0xA0)
-            return scc->wave[adr >> 5][adr & 0x1f];
-        else if (0xC0 < adr && adr < 0xF0)
-            return scc->reg[adr - 0xC0];
+            return scc.wave[adr >> 5][adr & 0x1f];
+        else if (0xC0 <= adr && adr < 0xF0)
+            return scc.reg[adr - 0xC0];
         else
             return 0;
     }
 
-    void setMask(uint32_t mask) { scc->mask = mask; }
-    void toggleMask(uint32_t mask) { scc->mask ^= mask; }
+    void setMask(uint32_t mask) { scc.mask = mask; }
+    void toggleMask(uint32_t mask) { scc.mask ^= mask; }
+
+    // Gains of the channel to the left and right of calcBlockStereo (0 to 256, default 256 for both)
+    void setPan(int ch, int left, int right)
+    {
+        if (0 <= ch && ch < 5) {
+            pan[ch][0] = left < 0 ? 0 : (256 < left ? 256 : left);
+            pan[ch][1] = right < 0 ? 0 : (256 < right ? 256 : right);
+            panned = false;
+            for (int i = 0; i < 5; i++) {
+                panned |= 256 != pan[i][0] || 256 != pan[i][1];
+            }
+        }
+    }
+
+    /**
+     * Render the interleaved left and right samples (buf has samples * 2 elements) with the pans.
+     * The output of both sides is the same as calcBlock while the pans are the default.
+     */
+    void calcBlockStereo(int16_t* buf, int samples)
+    {
+        if (!panned) {
+            // render to the latter half, and spread it from the head
+            calcBlock(&buf[samples], samples);
+            for (int i = 0; i < samples; i++) {
+                int16_t w = buf[samples + i];
+                buf[i * 2] = w;
+                buf[i * 2 + 1] = w;
+            }
+            return;
+        }
+        render<OutputStereo>(buf, NULL, samples);
+    }
+
+    // Render the output of each channel to stems[0-4] (NULL skips the channel), and the output to buf
+    void calcBlockStems(int16_t* const* stems, int16_t* buf, int samples)
+    {
+        render<OutputStems>(buf, stems, samples);
+    }
 
     // mapper function for VGM format
     inline void write_waveform1(uint32_t adr, uint32_t val) { writeReg(adr & 0x7F, val); }
@@ -689,13 +2244,557 @@ class EMU2212
     inline void write_keyoff(uint32_t val) { writeReg(0xE1, val); }
     inline void write_test(uint32_t val) { writeReg(0xE2, val); }
 
+    /**
+     * Advance the state by the samples without the output.
+     * The state is exactly the same as calcBlock with the Scalar or Simd engine.
+     */
+    void skip(int samples)
+    {
+        uint64_t ticks = count_ticks(samples);
+        update_levels();
+        for (int i = 0; i < 5; i++) {
+            skip_channel(i, ticks);
+        }
+        if (0 < samples) {
+            mix_output();
+            fir_clear();
+        }
+    }
+
+    /**
+     * Whether the output is a constant until the next register write: every channel is keyed off, muted or at
+     * volume 0, and its ch_out has settled. The Scalar and Simd engines only advance the counters meanwhile.
+     */
+    bool isIdle()
+    {
+        for (int i = 0; i < 5; i++) {
+            if (scc.volume[i] && !(scc.mask & SCC_MASK_CH(i)) && ((scc.ch_enable | scc.ch_enable_next) & (1 << i))) {
+                return false;
+            }
+            if (0 != scc.ch_out[i] && -1 != scc.ch_out[i]) {
+                return false; // still decays toward 0 or -1
+            }
+        }
+        return true;
+    }
+
   private:
+    // Render with the engine: buf and stems are written by put_sample
+    template <int Output>
+    void render(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        if ((Engine::Scalar == engine || Engine::Simd == engine) && isIdle()) {
+            calcBlockIdle<Output>(buf, stems, samples);
+            return;
+        }
+#if defined(SCCVGM_AVX2)
+        if (Engine::Simd == engine) {
+            calcBlockAVX2<Output>(buf, stems, samples);
+            return;
+        }
+#endif
+        if (Engine::Analytic == engine) {
+            calcBlockAnalytic<Output>(buf, stems, samples);
+            return;
+        }
+        if (Engine::Mipmap == engine) {
+            calcBlockMipmap<Output>(buf, stems, samples);
+            return;
+        }
+        if (Engine::Fir == engine) {
+            calcBlockFir<Output>(buf, stems, samples);
+            return;
+        }
+        calcBlockScalar<Output>(buf, stems, samples);
+    }
+
+    // Write the sample n from ch_out: out to buf, or the sides interleaved to buf (OutputStereo), and the stems
+    template <int Output>
+    inline void put_sample(int16_t* buf, int16_t* const* stems, int n)
+    {
+        int16_t out = mix_output();
+        if (OutputStereo == Output) {
+            int32_t left = 0;
+            int32_t right = 0;
+            for (int ch = 0; ch < 5; ch++) {
+                left += scc.ch_out[ch] * pan[ch][0];
+                right += scc.ch_out[ch] * pan[ch][1];
+            }
+            buf[n * 2] = (int16_t)(left >> 8);
+            buf[n * 2 + 1] = (int16_t)(right >> 8);
+        } else {
+            buf[n] = out;
+            if (OutputStems == Output) {
+                for (int ch = 0; ch < 5; ch++) {
+                    if (stems[ch]) {
+                        stems[ch][n] = scc.ch_out[ch];
+                    }
+                }
+            }
+        }
+    }
+
+    // the ticks of update_output in the samples (advances scctime)
+    uint64_t count_ticks(int samples)
+    {
+        uint32_t realstep = scc.realstep;
+        uint32_t sccstep = scc.sccstep;
+        uint32_t scctime = scc.scctime;
+        uint64_t ticks = 0;
+        for (int i = 0; i < samples; i++) {
+            if (realstep > scctime) {
+                uint32_t n = (realstep - scctime + sccstep - 1) / sccstep;
+                scctime += n * sccstep;
+                ticks += n;
+            }
+            scctime -= realstep;
+        }
+        scc.scctime = scctime;
+        return ticks;
+    }
+
+    // The ticks of update_output in the next sample without counting them one by one:
+    // scctime stays below sccstep, so they are realstep / sccstep (minTicks) or one more
+    static inline uint32_t next_ticks(uint32_t* scctime, uint32_t realstep, uint32_t sccstep, uint32_t minTicks)
+    {
+        uint32_t time = *scctime + minTicks * sccstep;
+        uint32_t ticks = minTicks;
+        if (realstep > time) {
+            time += sccstep;
+            ticks++;
+        }
+        *scctime = time - realstep;
+        return ticks;
+    }
+
+    template <int Output = OutputMono>
+    void calcBlockScalar(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        uint32_t realstep = scc.realstep;
+        uint32_t sccstep = scc.sccstep;
+        uint32_t scctime = scc.scctime;
+        uint32_t minTicks = realstep / sccstep;
+        for (int i = 0; i < samples; i++) {
+            for (uint32_t ticks = next_ticks(&scctime, realstep, sccstep, minTicks); ticks; ticks--) {
+                update_output();
+            }
+            put_sample<Output>(buf, stems, i);
+        }
+        scc.scctime = scctime;
+    }
+
+    // calcBlock while isIdle: the counters advance as skip does, and every sample is the settled output
+    template <int Output>
+    void calcBlockIdle(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        uint64_t ticks = count_ticks(samples);
+        update_levels();
+        for (int i = 0; i < 5; i++) {
+            skip_channel(i, ticks);
+        }
+        if (OutputMono != Output) {
+            for (int i = 0; i < samples; i++) {
+                put_sample<Output>(buf, stems, i);
+            }
+            return;
+        }
+        int16_t out = mix_output();
+        for (int i = 0; i < samples; i++) {
+            buf[i] = out;
+        }
+    }
+
+    // ch_out after the ticks that add the same level: (ch_out + level) >> 1 repeated is level + ((ch_out - level) >> ticks)
+    static inline int16_t settle(int16_t out, int16_t level, uint64_t ticks)
+    {
+        int32_t diff = out - level;
+        return (int16_t)(level + (ticks < 24 ? diff >> ticks : (diff < 0 ? -1 : 0)));
+    }
+
+    // update_output of a channel repeated by the ticks
+    void skip_channel(int i, uint64_t ticks)
+    {
+        const uint32_t countMask = (1 << (GETA_BITS + 5)) - 1;
+        const int bit = 1 << i;
+        const uint32_t incr = scc.incr[i];
+        int16_t out = scc.ch_out[i];
+        if (!incr) {
+            // the phase does not move, and the key state never changes
+            int16_t x = 0;
+            if (ticks && (scc.ch_enable & bit)) {
+                scc.phase[i] = ((scc.count[i] >> GETA_BITS) + scc.offset[i]) & 0x1F;
+                x = (scc.mask & SCC_MASK_CH(i)) ? 0 : level[i][scc.phase[i]];
+            }
+            scc.ch_out[i] = settle(out, x, ticks);
+            return;
+        }
+
+        // the offset or the key state changes at the end of the waveform: step the ticks until it settles
+        uint32_t count = scc.count[i];
+        while (ticks && (scc.rotate[i] || scc.offset[i] || ((scc.ch_enable ^ scc.ch_enable_next) & bit))) {
+            count += incr;
+            if (count & (1 << (GETA_BITS + 5))) {
+                count &= countMask;
+                scc.offset[i] = (scc.offset[i] + 31) & scc.rotate[i];
+                scc.ch_enable &= ~bit;
+                scc.ch_enable |= scc.ch_enable_next & bit;
+            }
+            if (scc.ch_enable & bit) {
+                scc.phase[i] = ((count >> GETA_BITS) + scc.offset[i]) & 0x1F;
+                if (!(scc.mask & SCC_MASK_CH(i)))
+                    out += level[i][scc.phase[i]];
+            }
+            out >>= 1;
+            ticks--;
+        }
+
+        if (!(scc.ch_enable & bit) || (scc.mask & SCC_MASK_CH(i)) || !scc.volume[i]) {
+            // silent: only the counter moves
+            count = (uint32_t)((count + (uint64_t)incr * ticks) & countMask);
+            if (ticks && (scc.ch_enable & bit)) {
+                scc.phase[i] = count >> GETA_BITS;
+            }
+            out = settle(out, 0, ticks);
+        } else if (ticks) {
+            // runs of the ticks in the same phase
+            while (ticks) {
+                uint32_t phase = count >> GETA_BITS;
+                uint64_t run = ((((uint64_t)phase + 1) << GETA_BITS) - 1 - count) / incr;
+                if (!run) {
+                    count = (count + incr) & countMask;
+                    out = (int16_t)(out + level[i][count >> GETA_BITS]) >> 1;
+                    ticks--;
+                } else {
+                    run = run < ticks ? run : ticks;
+                    count += (uint32_t)(run * incr);
+                    out = settle(out, level[i][phase], run);
+                    ticks -= run;
+                }
+            }
+            scc.phase[i] = count >> GETA_BITS;
+        }
+        scc.count[i] = count;
+        scc.ch_out[i] = out;
+    }
+
     void internal_refresh()
     {
-        scc->base_incr = 2 << GETA_BITS;
-        scc->realstep = (uint32_t)((1 << 31) / scc->rate);
-        scc->sccstep = (uint32_t)((1 << 31) / (scc->clk / 2));
-        scc->scctime = 0;
+        scc.base_incr = 2 << GETA_BITS;
+        scc.realstep = (uint32_t)((1 << 31) / scc.rate);
+        scc.sccstep = (uint32_t)((1 << 31) / (scc.clk / 2));
+        scc.scctime = 0;
+    }
+
+    void update_levels()
+    {
+        for (int i = 0; i < 5; i++) {
+            if (level_dirty & (1 << i)) {
+                level_sum[i][0] = 0;
+                for (int p = 0; p < 32; p++) {
+                    level[i][p] = (int16_t)((scc.volume[i] * scc.wave[i][p]) & 0xfff0);
+                    level_sum[i][p + 1] = level_sum[i][p] + level[i][p];
+                }
+            }
+        }
+        level_dirty = 0;
+    }
+
+    template <int Output>
+    void calcBlockAnalytic(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        const uint32_t countMask = (1 << (GETA_BITS + 5)) - 1;
+        const int64_t levelUnit = (int64_t)1 << GETA_BITS;
+        int i;
+
+        update_levels();
+
+        uint32_t realstep = scc.realstep;
+        uint32_t sccstep = scc.sccstep;
+        uint32_t scctime = scc.scctime;
+        uint32_t minTicks = realstep / sccstep;
+        for (int n = 0; n < samples; n++) {
+            uint32_t ticks = next_ticks(&scctime, realstep, sccstep, minTicks);
+            if (!ticks) {
+                put_sample<Output>(buf, stems, n);
+                continue;
+            }
+            for (i = 0; i < 5; i++) {
+                int bit = 1 << i;
+                if (scc.rotate[i] || scc.offset[i] || ((scc.ch_enable ^ scc.ch_enable_next) & bit)) {
+                    // the offset or the key state changes at the end of the waveform: step the ticks
+                    int32_t sum = 0;
+                    for (uint32_t t = 0; t < ticks; t++) {
+                        scc.count[i] += scc.incr[i];
+                        if (scc.count[i] & (1 << (GETA_BITS + 5))) {
+                            scc.count[i] &= countMask;
+                            scc.offset[i] = (scc.offset[i] + 31) & scc.rotate[i];
+                            scc.ch_enable &= ~bit;
+                            scc.ch_enable |= scc.ch_enable_next & bit;
+                        }
+                        if (scc.ch_enable & bit) {
+                            scc.phase[i] = ((scc.count[i] >> GETA_BITS) + scc.offset[i]) & 0x1F;
+                            if (!(scc.mask & SCC_MASK_CH(i)))
+                                sum += level[i][scc.phase[i]];
+                        }
+                    }
+                    scc.ch_out[i] = (int16_t)(sum / (int32_t)ticks);
+                    continue;
+                }
+                uint32_t from = scc.count[i];
+                uint64_t to = from + (uint64_t)scc.incr[i] * ticks;
+                scc.count[i] = (uint32_t)to & countMask;
+                if (!(scc.ch_enable & bit)) {
+                    scc.ch_out[i] = 0;
+                    continue;
+                }
+                scc.phase[i] = (scc.count[i] >> GETA_BITS) & 0x1F;
+                if (scc.mask & SCC_MASK_CH(i)) {
+                    scc.ch_out[i] = 0;
+                } else if (to == from) {
+                    scc.ch_out[i] = level[i][scc.phase[i]];
+                } else {
+                    // integral of the level over the phase positions [from, to)
+                    int64_t area = (int64_t)(to >> (GETA_BITS + 5)) * level_sum[i][32] * levelUnit;
+                    area += level_sum[i][(to >> GETA_BITS) & 0x1F] * levelUnit + level[i][(to >> GETA_BITS) & 0x1F] * (int64_t)(to & (levelUnit - 1));
+                    area -= level_sum[i][from >> GETA_BITS] * levelUnit + level[i][from >> GETA_BITS] * (int64_t)(from & (levelUnit - 1));
+                    scc.ch_out[i] = (int16_t)(area / (int64_t)(to - from));
+                }
+            }
+            put_sample<Output>(buf, stems, n);
+        }
+        scc.scctime = scctime;
+    }
+
+    // Fir: the levels of a block of ticks are written to the decimators at once, and filtered per sample
+    template <int Output>
+    void calcBlockFir(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        uint32_t realstep = scc.realstep;
+        uint32_t sccstep = scc.sccstep;
+        const int tracks = OutputStereo == Output ? 3 : (OutputStems == Output ? 6 : 1);
+        Decimator* track[6] = {&fir, &fir_extra[0], &fir_extra[1], &fir_extra[2], &fir_extra[3], &fir_extra[4]};
+        for (int k = 0; k < tracks; k++) {
+            if (!track[k]->prepare(realstep, sccstep)) {
+                fir_output = OutputMono;
+                calcBlockScalar<Output>(buf, stems, samples); // no memory for the decimator
+                return;
+            }
+        }
+        update_levels();
+        if (fir_output != Output) {
+            // the decimators of the Output start from the levels at the current phases
+            int32_t lv[5];
+            float value[6];
+            float* x[6] = {&value[0], &value[1], &value[2], &value[3], &value[4], &value[5]};
+            for (int i = 0; i < 5; i++) {
+                lv[i] = (scc.ch_enable & (1 << i)) && !(scc.mask & SCC_MASK_CH(i)) ? level[i][scc.phase[i]] : 0;
+            }
+            put_ticks<Output>(x, 0, lv);
+            for (int k = 1; k < tracks; k++) {
+                track[k]->clear(value[k]);
+            }
+            fir_output = Output;
+        }
+        const int blockTicks = fir.getBlockTicks();
+        const uint32_t minTicks = realstep / sccstep;
+        uint32_t ticks[FirBlock];
+        uint32_t times[FirBlock];
+        float* x[6];
+        for (int n = 0; n < samples;) {
+            // the ticks of the samples in the block (a sample has minTicks + 1 ticks at most)
+            int count = 0;
+            int total = 0;
+            uint32_t scctime = scc.scctime;
+            while (count < FirBlock && n + count < samples && total + (int)minTicks + 1 <= blockTicks) {
+                ticks[count] = next_ticks(&scctime, realstep, sccstep, minTicks);
+                times[count] = scctime;
+                total += (int)ticks[count++];
+            }
+            scc.scctime = scctime;
+            for (int k = 0; k < tracks; k++) {
+                x[k] = track[k]->reserve(total);
+            }
+            tick_levels<Output>(x, total);
+            for (int i = 0; i < count; i++, n++) {
+                for (int k = 0; k < tracks; k++) {
+                    track[k]->advance((int)ticks[i]);
+                }
+                scc.out = Decimator::clamp(fir.output(times[i]));
+                if (OutputStereo == Output) {
+                    buf[n * 2] = Decimator::clamp(track[1]->output(times[i]));
+                    buf[n * 2 + 1] = Decimator::clamp(track[2]->output(times[i]));
+                    continue;
+                }
+                buf[n] = scc.out;
+                if (OutputStems == Output) {
+                    for (int ch = 0; ch < 5; ch++) {
+                        if (stems[ch]) {
+                            stems[ch][n] = Decimator::clamp(track[1 + ch]->output(times[i]));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Write the levels of the ticks to the tracks of the Output (update_levels is required)
+    template <int Output>
+    void tick_levels(float* const* x, int ticks)
+    {
+#if defined(SCCVGM_AVX2)
+        if (isSimdSupported()) {
+            tickLevelsAVX2<Output>(x, ticks);
+            return;
+        }
+#endif
+        const uint32_t countMask = (1 << (GETA_BITS + 5)) - 1;
+        for (int t = 0; t < ticks; t++) {
+            int32_t lv[5];
+            for (int i = 0; i < 5; i++) {
+                lv[i] = 0;
+                scc.count[i] += scc.incr[i];
+                if (scc.count[i] & (1 << (GETA_BITS + 5))) {
+                    scc.count[i] &= countMask;
+                    scc.offset[i] = (scc.offset[i] + 31) & scc.rotate[i];
+                    scc.ch_enable &= ~(1 << i);
+                    scc.ch_enable |= scc.ch_enable_next & (1 << i);
+                }
+                if (scc.ch_enable & (1 << i)) {
+                    scc.phase[i] = ((scc.count[i] >> GETA_BITS) + scc.offset[i]) & 0x1F;
+                    if (!(scc.mask & SCC_MASK_CH(i)))
+                        lv[i] = level[i][scc.phase[i]];
+                }
+            }
+            put_ticks<Output>(x, t, lv);
+        }
+    }
+
+    // Write the tick t of the tracks from the levels of the channels: the sum, then the sides or the channels
+    template <int Output>
+    inline void put_ticks(float* const* x, int t, const int32_t* lv)
+    {
+        x[0][t] = (float)(lv[0] + lv[1] + lv[2] + lv[3] + lv[4]);
+        if (OutputStereo == Output) {
+            for (int side = 0; side < 2; side++) {
+                int32_t sum = 0;
+                for (int ch = 0; ch < 5; ch++) {
+                    sum += lv[ch] * pan[ch][side];
+                }
+                x[1 + side][t] = (float)sum * (1.0f / 256);
+            }
+        } else if (OutputStems == Output) {
+            for (int ch = 0; ch < 5; ch++) {
+                x[1 + ch][t] = (float)lv[ch];
+            }
+        }
+    }
+
+    void fir_clear()
+    {
+        if (Engine::Fir == engine) {
+            fir.prepare(scc.realstep, scc.sccstep);
+            fir.clear(scc.out);
+        }
+        fir_output = OutputMono;
+    }
+
+    // Rebuild the band-limited copies of the waveform of a channel from its harmonics
+    void build_mipmap(int ch)
+    {
+        static const struct Basis {
+            float cos[32], sin[32];
+            Basis()
+            {
+                for (int i = 0; i < 32; i++) {
+                    cos[i] = (float)::cos(3.14159265358979323846 * i / 16);
+                    sin[i] = (float)::sin(3.14159265358979323846 * i / 16);
+                }
+            }
+        } basis;
+        float re[17], im[17];
+        for (int k = 0; k <= 16; k++) {
+            re[k] = im[k] = 0;
+            for (int n = 0; n < 32; n++) {
+                re[k] += scc.wave[ch][n] * basis.cos[(k * n) & 31];
+                im[k] -= scc.wave[ch][n] * basis.sin[(k * n) & 31];
+            }
+        }
+        for (int level = 0; level < MipmapLevels; level++) {
+            int harmonics = 16 >> level;
+            for (int n = 0; n < 32; n++) {
+                float value = re[0];
+                for (int k = 1; k <= harmonics; k++) {
+                    float weight = k == 16 ? 1.0f : 2.0f; // the Nyquist harmonic has no mirror
+                    value += weight * (re[k] * basis.cos[(k * n) & 31] - im[k] * basis.sin[(k * n) & 31]);
+                }
+                mipmap[ch][level][n] = value / 32;
+            }
+        }
+    }
+
+    template <int Output>
+    void calcBlockMipmap(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        const uint32_t countMask = (1 << (GETA_BITS + 5)) - 1;
+        const float fractionUnit = 1.0f / (1 << GETA_BITS);
+        const float* table[5];
+        int i;
+
+        for (i = 0; i < 5; i++) {
+            if (mipmap_dirty & (1 << i)) {
+                build_mipmap(i);
+            }
+            // the highest harmonic must be below the Nyquist frequency: harmonics * incr * ticks per sample < 2^(GETA_BITS + 5) / 2
+            double limit = (double)(1 << (GETA_BITS + 4)) * scc.sccstep / scc.realstep;
+            int level = 0;
+            while (level < MipmapLevels - 1 && limit <= (double)(16 >> level) * scc.incr[i]) {
+                level++;
+            }
+            table[i] = mipmap[i][level];
+        }
+        mipmap_dirty = 0;
+
+        uint32_t realstep = scc.realstep;
+        uint32_t sccstep = scc.sccstep;
+        uint32_t scctime = scc.scctime;
+        uint32_t minTicks = realstep / sccstep;
+        for (int n = 0; n < samples; n++) {
+            uint32_t ticks = next_ticks(&scctime, realstep, sccstep, minTicks);
+            for (i = 0; i < 5; i++) {
+                int bit = 1 << i;
+                if (scc.rotate[i] || scc.offset[i] || ((scc.ch_enable ^ scc.ch_enable_next) & bit)) {
+                    // the offset or the key state changes at the end of the waveform: step the ticks
+                    for (uint32_t t = 0; t < ticks; t++) {
+                        scc.count[i] += scc.incr[i];
+                        if (scc.count[i] & (1 << (GETA_BITS + 5))) {
+                            scc.count[i] &= countMask;
+                            scc.offset[i] = (scc.offset[i] + 31) & scc.rotate[i];
+                            scc.ch_enable &= ~bit;
+                            scc.ch_enable |= scc.ch_enable_next & bit;
+                        }
+                        if (scc.ch_enable & bit)
+                            scc.phase[i] = ((scc.count[i] >> GETA_BITS) + scc.offset[i]) & 0x1F;
+                    }
+                } else {
+                    scc.count[i] = (uint32_t)(scc.count[i] + (uint64_t)scc.incr[i] * ticks) & countMask;
+                }
+                if (!(scc.ch_enable & bit)) {
+                    scc.ch_out[i] = 0;
+                    continue;
+                }
+                scc.phase[i] = ((scc.count[i] >> GETA_BITS) + scc.offset[i]) & 0x1F;
+                if (scc.mask & SCC_MASK_CH(i)) {
+                    scc.ch_out[i] = 0;
+                    continue;
+                }
+                float a = table[i][scc.phase[i]];
+                float b = table[i][(scc.phase[i] + 1) & 0x1F];
+                float value = a + (b - a) * ((scc.count[i] & ((1 << GETA_BITS) - 1)) * fractionUnit);
+                scc.ch_out[i] = (int16_t)lrintf(value * scc.volume[i]);
+            }
+            put_sample<Output>(buf, stems, n);
+        }
+        scc.scctime = scctime;
     }
 
     inline void update_output()
@@ -703,29 +2802,214 @@ class EMU2212
         int i;
 
         for (i = 0; i < 5; i++) {
-            scc->count[i] = (scc->count[i] + scc->incr[i]);
+            scc.count[i] = (scc.count[i] + scc.incr[i]);
+
+            if (scc.count[i] & (1 << (GETA_BITS + 5))) {
+                scc.count[i] &= ((1 << (GETA_BITS + 5)) - 1);
+                scc.offset[i] = (scc.offset[i] + 31) & scc.rotate[i];
+                scc.ch_enable &= ~(1 << i);
+                scc.ch_enable |= scc.ch_enable_next & (1 << i);
+            }
 
-            if (scc->count[i] & (1 << (GETA_BITS + 5))) {
-                scc->count[i] &= ((1 << (GETA_BITS + 5)) - 1);
-                scc->offset[i] = (scc->offset[i] + 31) & scc->rotate[i];
-                scc->ch_enable &= ~(1 << i);
-                scc->ch_enable |= scc->ch_enable_next & (1 << i);
+            if (scc.ch_enable & (1 << i)) {
+                scc.phase[i] = ((scc.count[i] >> (GETA_BITS)) + scc.offset[i]) & 0x1F;
+                if (!(scc.mask & SCC_MASK_CH(i)))
+                    scc.ch_out[i] += (scc.volume[i] * scc.wave[i][scc.phase[i]]) & 0xfff0;
             }
 
-            if (scc->ch_enable & (1 << i)) {
-                scc->phase[i] = ((scc->count[i] >> (GETA_BITS)) + scc->offset[i]) & 0x1F;
-                if (!(scc->mask & SCC_MASK_CH(i)))
-                    scc->ch_out[i] += (scc->volume[i] * scc->wave[i][scc->phase[i]]) & 0xfff0;
+            scc.ch_out[i] >>= 1;
+        }
+    }
+
+#if defined(SCCVGM_AVX2)
+    // channel states of the 5 channels in the lanes 0-4 (the lanes 5-7 are idle)
+    struct Lanes {
+        __m256i incr, count, offset, rotate, phase, out, enable, next, audible;
+    };
+
+    SCCVGM_AVX2 inline void load_lanes(Lanes& v)
+    {
+        const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(5), lane);
+        const __m256i bit = _mm256_sllv_epi32(_mm256_set1_epi32(1), lane);
+        int32_t tmp[8];
+        int i;
+        for (i = 0; i < 8; i++) tmp[i] = i < 5 ? (int32_t)scc.incr[i] : 0;
+        v.incr = _mm256_loadu_si256((const __m256i*)tmp);
+        for (i = 0; i < 8; i++) tmp[i] = i < 5 ? (int32_t)scc.count[i] : 0;
+        v.count = _mm256_loadu_si256((const __m256i*)tmp);
+        for (i = 0; i < 8; i++) tmp[i] = i < 5 ? (int32_t)scc.offset[i] : 0;
+        v.offset = _mm256_loadu_si256((const __m256i*)tmp);
+        for (i = 0; i < 8; i++) tmp[i] = i < 5 ? scc.rotate[i] : 0;
+        v.rotate = _mm256_loadu_si256((const __m256i*)tmp);
+        for (i = 0; i < 8; i++) tmp[i] = i < 5 ? (int32_t)scc.phase[i] : 0;
+        v.phase = _mm256_loadu_si256((const __m256i*)tmp);
+        for (i = 0; i < 8; i++) tmp[i] = i < 5 ? scc.ch_out[i] : 0;
+        v.out = _mm256_loadu_si256((const __m256i*)tmp);
+        v.enable = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(scc.ch_enable), bit), bit);
+        v.next = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(scc.ch_enable_next), bit), bit);
+        v.enable = _mm256_and_si256(v.enable, active);
+        v.next = _mm256_and_si256(v.next, active);
+        v.audible = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(scc.mask), bit), _mm256_setzero_si256());
+    }
+
+    SCCVGM_AVX2 inline void store_lanes(const Lanes& v)
+    {
+        int32_t tmp[8];
+        int i;
+        _mm256_storeu_si256((__m256i*)tmp, v.count);
+        for (i = 0; i < 5; i++) scc.count[i] = (uint32_t)tmp[i];
+        _mm256_storeu_si256((__m256i*)tmp, v.offset);
+        for (i = 0; i < 5; i++) scc.offset[i] = (uint32_t)tmp[i];
+        _mm256_storeu_si256((__m256i*)tmp, v.phase);
+        for (i = 0; i < 5; i++) scc.phase[i] = (uint32_t)tmp[i];
+        _mm256_storeu_si256((__m256i*)tmp, v.out);
+        for (i = 0; i < 5; i++) scc.ch_out[i] = (int16_t)tmp[i];
+        int enabled = _mm256_movemask_ps(_mm256_castsi256_ps(v.enable));
+        scc.ch_enable = (scc.ch_enable & ~0x1F) | (enabled & 0x1F);
+    }
+
+    // advance the counters of a tick, and return the levels of the audible channels (update_levels is required)
+    SCCVGM_AVX2 inline __m256i tick_lanes(Lanes& v)
+    {
+        const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i countMask = _mm256_set1_epi32((1 << (GETA_BITS + 5)) - 1);
+        const __m256i thirtyOne = _mm256_set1_epi32(31);
+        const __m256i base = _mm256_and_si256(_mm256_slli_epi32(lane, 5), _mm256_cmpgt_epi32(_mm256_set1_epi32(5), lane));
+        v.count = _mm256_add_epi32(v.count, v.incr);
+        __m256i carry = _mm256_cmpgt_epi32(v.count, countMask);
+        v.count = _mm256_and_si256(v.count, countMask);
+        v.offset = _mm256_blendv_epi8(v.offset, _mm256_and_si256(_mm256_add_epi32(v.offset, thirtyOne), v.rotate), carry);
+        v.enable = _mm256_blendv_epi8(v.enable, v.next, carry);
+        __m256i p = _mm256_and_si256(_mm256_add_epi32(_mm256_srli_epi32(v.count, GETA_BITS), v.offset), thirtyOne);
+        v.phase = _mm256_blendv_epi8(v.phase, p, v.enable);
+        // gather the levels of the phases (the lanes 5 to 7 read the channel 0, and are masked by enable)
+        __m256i w = _mm256_i32gather_epi32(&level[0][0], _mm256_add_epi32(base, p), 4);
+        return _mm256_and_si256(w, _mm256_and_si256(v.enable, v.audible));
+    }
+
+    // gains of the side in the lanes
+    SCCVGM_AVX2 inline __m256i pan_lanes(int side)
+    {
+        int32_t tmp[8];
+        for (int i = 0; i < 8; i++) tmp[i] = i < 5 ? pan[i][side] : 0;
+        return _mm256_loadu_si256((const __m256i*)tmp);
+    }
+
+    SCCVGM_AVX2 static inline int32_t hsum_lanes(__m256i v)
+    {
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum);
+    }
+
+    // the sums of the lanes of 8 vectors: the pairs of vectors, then the halves
+    SCCVGM_AVX2 static inline __m256 hsum8_lanes(const __m256i* w)
+    {
+        __m256i lo = _mm256_hadd_epi32(_mm256_hadd_epi32(w[0], w[1]), _mm256_hadd_epi32(w[2], w[3]));
+        __m256i hi = _mm256_hadd_epi32(_mm256_hadd_epi32(w[4], w[5]), _mm256_hadd_epi32(w[6], w[7]));
+        __m256i sum = _mm256_add_epi32(_mm256_permute2x128_si256(lo, hi, 0x20), _mm256_permute2x128_si256(lo, hi, 0x31));
+        return _mm256_cvtepi32_ps(sum);
+    }
+
+    // update_output of the 5 channels in the lanes
+    template <int Output>
+    SCCVGM_AVX2 void calcBlockAVX2(int16_t* buf, int16_t* const* stems, int samples)
+    {
+        Lanes v;
+        load_lanes(v);
+        const __m256i panLeft = pan_lanes(0);
+        const __m256i panRight = pan_lanes(1);
+        int32_t tmp[8];
+        update_levels();
+        uint32_t realstep = scc.realstep;
+        uint32_t sccstep = scc.sccstep;
+        uint32_t scctime = scc.scctime;
+        uint32_t minTicks = realstep / sccstep;
+        for (int n = 0; n < samples; n++) {
+            for (uint32_t ticks = next_ticks(&scctime, realstep, sccstep, minTicks); ticks; ticks--) {
+                // ch_out is int16_t: wrap the sum to 16 bits, then shift arithmetically
+                v.out = _mm256_srai_epi32(_mm256_slli_epi32(_mm256_add_epi32(v.out, tick_lanes(v)), 16), 16);
+                v.out = _mm256_srai_epi32(v.out, 1);
+            }
+            if (OutputStereo == Output) {
+                buf[n * 2] = (int16_t)(hsum_lanes(_mm256_mullo_epi32(v.out, panLeft)) >> 8);
+                buf[n * 2 + 1] = (int16_t)(hsum_lanes(_mm256_mullo_epi32(v.out, panRight)) >> 8);
+                continue;
+            }
+            buf[n] = (int16_t)hsum_lanes(v.out);
+            if (OutputStems == Output) {
+                _mm256_storeu_si256((__m256i*)tmp, v.out);
+                for (int ch = 0; ch < 5; ch++) {
+                    if (stems[ch]) {
+                        stems[ch][n] = (int16_t)tmp[ch];
+                    }
+                }
             }
+        }
+        scc.scctime = scctime;
+        store_lanes(v);
+        if (samples) {
+            mix_output();
+        }
+    }
 
-            scc->ch_out[i] >>= 1;
+    // the levels of the ticks for the Fir engine
+    template <int Output>
+    SCCVGM_AVX2 void tickLevelsAVX2(float* const* x, int ticks)
+    {
+        Lanes v;
+        load_lanes(v);
+        const __m256i panLeft = pan_lanes(0);
+        const __m256i panRight = pan_lanes(1);
+        const __m256 unit = _mm256_set1_ps(1.0f / 256);
+        int32_t tmp[8];
+        int t = 0;
+        for (; t + 8 <= ticks; t += 8) {
+            __m256i w[8];
+            for (int k = 0; k < 8; k++) {
+                w[k] = tick_lanes(v);
+            }
+            _mm256_storeu_ps(&x[0][t], hsum8_lanes(w));
+            if (OutputStereo == Output) {
+                __m256i left[8], right[8];
+                for (int k = 0; k < 8; k++) {
+                    left[k] = _mm256_mullo_epi32(w[k], panLeft);
+                    right[k] = _mm256_mullo_epi32(w[k], panRight);
+                }
+                _mm256_storeu_ps(&x[1][t], _mm256_mul_ps(hsum8_lanes(left), unit));
+                _mm256_storeu_ps(&x[2][t], _mm256_mul_ps(hsum8_lanes(right), unit));
+            } else if (OutputStems == Output) {
+                for (int k = 0; k < 8; k++) {
+                    _mm256_storeu_si256((__m256i*)tmp, w[k]);
+                    for (int ch = 0; ch < 5; ch++) {
+                        x[1 + ch][t + k] = (float)tmp[ch];
+                    }
+                }
+            }
+        }
+        for (; t < ticks; t++) {
+            __m256i w = tick_lanes(v);
+            x[0][t] = (float)hsum_lanes(w);
+            if (OutputStereo == Output) {
+                x[1][t] = (float)hsum_lanes(_mm256_mullo_epi32(w, panLeft)) * (1.0f / 256);
+                x[2][t] = (float)hsum_lanes(_mm256_mullo_epi32(w, panRight)) * (1.0f / 256);
+            } else if (OutputStems == Output) {
+                _mm256_storeu_si256((__m256i*)tmp, w);
+                for (int ch = 0; ch < 5; ch++) {
+                    x[1 + ch][t] = (float)tmp[ch];
+                }
+            }
         }
+        store_lanes(v);
     }
+#endif
 
     inline int16_t mix_output()
     {
-        scc->out = scc->ch_out[0] + scc->ch_out[1] + scc->ch_out[2] + scc->ch_out[3] + scc->ch_out[4];
-        return (int16_t)scc->out;
+        scc.out = scc.ch_out[0] + scc.ch_out[1] + scc.ch_out[2] + scc.ch_out[3] + scc.ch_out[4];
+        return (int16_t)scc.out;
     }
 
     inline void write_standard(uint32_t adr, uint32_t val)
@@ -809,74 +3093,92 @@ class EMU2212
     }
 };
 
-class VgmDriver
+// Chips compiled into BasicVgmDriver
+enum class VgmChips {
+    PSG = 1,
+    SCC = 2,
+    All = 3,
+};
+
+/**
+ * VGM song compiled into the event stream once at load, and immutable after that.
+ * Any number of drivers can play a song at the same time (VgmDriver::load(const VgmSong*)), even on other threads,
+ * so that a driver for another listener costs only the state of the chips.
+ */
+class VgmSong
 {
+    template <VgmChips Chips, int Rate>
+    friend class BasicVgmDriver;
+
   private:
-    enum EmulatorType {
-        ET_PSG = 0,
-        ET_SCC,
-        ET_Length
+    enum EventType {
+        EV_Wait = 0,
+        EV_PSG,
+        EV_SCC,
+        EV_End,
+        EV_Stop,
+        EV_Stereo, // AY-3-8910 stereo mask
     };
 
-    struct Emulator {
-        EMU2149* psg;
-        EMU2212* scc;
-    } emu;
-
-    struct VgmContext {
-        uint32_t clocks[ET_Length];
-        const uint8_t* data;
-        size_t size;
-        int version;
-        int head;
-        int cursor;
-        int loopOffset;
-        int wait;
-        bool end;
-        uint32_t loopCount;
-        uint32_t loopCycle;
-        uint32_t currentCycle;
-        uint32_t totalCycle;
-    } vgm;
+    // A VGM command compiled at load: write a register, then wait for `wait` samples
+    struct Event {
+        uint16_t wait;
+        uint8_t type;
+        uint8_t reg;
+        uint8_t value;
+    };
 
-    int masterVolume;
-    short waveMax;
-    short waveMin;
+    Event* events;
+    int eventCount;
+    int eventCapacity;
+    const uint8_t* data;
+    size_t size;
+    int version;
+    uint32_t clockPSG;
+    uint32_t clockSCC;
+    int loopIndex; // event at the loop point (-1: no loop)
+    uint32_t loopCycle;
+    uint32_t totalCycle;
 
   public:
-    VgmDriver(int rate = 44100)
+    VgmSong()
     {
-        emu.psg = new EMU2149(3579545, rate);
-        emu.scc = new EMU2212(3579545, rate);
-        masterVolume = 600;
-        this->setWaveSize(95);
+        events = NULL;
+        clear();
     }
 
-    ~VgmDriver()
+    ~VgmSong()
     {
-        delete emu.psg;
-        delete emu.scc;
+        free(events);
     }
 
-    void setMasterVolume(int masterVolume)
-    {
-        this->masterVolume = masterVolume;
-    }
+    // A song owns its events, and the drivers refer to it: play the same song with load(const VgmSong*) instead
+    VgmSong(const VgmSong&) = delete;
+    VgmSong& operator=(const VgmSong&) = delete;
 
-    void setWaveSize(int waveSizeInPercent)
+    void clear()
     {
-        if (waveSizeInPercent < 0) {
-            waveSizeInPercent = 0;
-        } else if (100 < waveSizeInPercent) {
-            waveSizeInPercent = 100;
-        }
-        this->waveMax = (short)((32767 * waveSizeInPercent) / 100);
-        this->waveMin = (short)((-32768 * waveSizeInPercent) / 100);
+        free(events);
+        events = NULL;
+        eventCount = 0;
+        eventCapacity = 0;
+        data = NULL;
+        size = 0;
+        version = 0;
+        clockPSG = 0;
+        clockSCC = 0;
+        loopIndex = -1;
+        loopCycle = 0;
+        totalCycle = 0;
     }
 
-    bool load(const uint8_t* data, size_t size)
+    /**
+     * Compile the VGM data (version 1.61 or later with PSG or SCC, or both).
+     * If keepData is false, the song does not keep any reference to data after load.
+     */
+    bool load(const uint8_t* data, size_t size, bool keepData = true)
     {
-        this->reset();
+        clear();
         if (size < 0x100) {
             return false;
         }
@@ -884,179 +3186,162 @@ class VgmDriver
             return false;
         }
 
-        memcpy(&vgm.version, &data[0x08], 4);
-        if (vgm.version < 0x161) {
+        memcpy(&version, &data[0x08], 4);
+        if (version < 0x161) {
             return false; // require version 1.61 or later
         }
 
-        vgm.data = data;
-        vgm.size = size;
-
-        memcpy(&vgm.clocks[ET_PSG], &data[0x74], 4);
-        memcpy(&vgm.clocks[ET_SCC], &data[0x9C], 4);
-
-        if (!vgm.clocks[ET_PSG] && !vgm.clocks[ET_SCC]) {
+        memcpy(&clockPSG, &data[0x74], 4);
+        memcpy(&clockSCC, &data[0x9C], 4);
+        if (!clockPSG && !clockSCC) {
             return false; // require PSG or SCC, or both
         }
 
-        if (vgm.clocks[ET_PSG]) {
-            emu.psg->setVolumeMode(2);
-            emu.psg->setClockDivider(1);
-        }
+        int head;
+        memcpy(&head, &data[0x34], 4);
+        head += 0x40 - 0x0C;
+        int loopOffset;
+        memcpy(&loopOffset, &data[0x1C], 4);
+        loopOffset += loopOffset ? 0x1C : 0;
 
-        if (vgm.clocks[ET_SCC]) {
-            emu.scc->set_type(EMU2212::Type::Standard);
+        // compile the commands and calculate total cycle and loop cycle
+        if (!compile(data, size, head, loopOffset)) {
+            clear();
+            return false;
         }
-
-        memcpy(&vgm.cursor, &data[0x34], 4);
-        vgm.cursor += 0x40 - 0x0C;
-        vgm.head = vgm.cursor;
-        memcpy(&vgm.loopOffset, &data[0x1C], 4);
-        vgm.loopOffset += vgm.loopOffset ? 0x1C : 0;
-
-        // calculate total cycle and loop cycle
-        while (execute(false)) {
-            vgm.wait = 0;
+        if (keepData) {
+            this->data = data;
+            this->size = size;
         }
-        vgm.cursor = vgm.head;
-        vgm.loopCount = 0;
-        vgm.currentCycle = 0;
         return true;
     }
 
-    void reset()
-    {
-        memset(&vgm, 0, sizeof(vgm));
-        emu.psg->reset();
-        emu.scc->reset();
-    }
+    bool isLoaded() const { return NULL != events; }
+    int getVersion() const { return version; }
+    uint32_t getClockPSG() const { return clockPSG; }
+    uint32_t getClockSCC() const { return clockSCC; }
+    uint32_t getLengthCycle() const { return totalCycle; }
+    uint32_t getLoopCycle() const { return loopCycle; }
+    const uint8_t* getData() const { return data; }
+    size_t getDataSize() const { return size; }
 
-    void render(int16_t* buf, int samples)
+  private:
+    // false: out of memory (events keeps the old block, and clear frees it)
+    bool addEvent(uint8_t type, uint8_t reg, uint8_t value)
     {
-        if (!vgm.data) {
-            memset(buf, 0, samples * 2);
-            return;
-        }
-        int cursor = 0;
-        while (cursor < samples) {
-            if (vgm.wait < 1) {
-                this->execute(true);
-            }
-            vgm.wait--;
-            int w = 0;
-            if (vgm.clocks[ET_PSG]) {
-                w += emu.psg->calc();
+        if (eventCount == eventCapacity) {
+            int capacity = eventCapacity ? eventCapacity * 2 : 1024;
+            Event* grown = (Event*)realloc(events, capacity * sizeof(Event));
+            if (!grown) {
+                return false;
             }
-            if (vgm.clocks[ET_SCC]) {
-                w += emu.scc->calc();
-            }
-            w *= masterVolume;
-            w /= 100;
-            if (waveMax < w) {
-                w = waveMax;
-            } else if (w < waveMin) {
-                w = waveMin;
-            }
-            buf[cursor] = w;
-            cursor++;
+            events = grown;
+            eventCapacity = capacity;
         }
+        Event* e = &events[eventCount++];
+        e->wait = 0;
+        e->type = type;
+        e->reg = reg;
+        e->value = value;
+        return true;
     }
 
-    bool isPlaying() { return !vgm.end; }
-    uint32_t getLoopCount() { return vgm.loopCount; }
-    uint32_t getFrequencyPSG(int ch) { return emu.psg->getFrequency(ch); }
-    uint32_t getFrequencySCC(int ch) { return emu.scc->getFrequency(ch); }
-    uint32_t getCurrentCycle() { return vgm.currentCycle; }
-    uint32_t getLengthCycle() { return vgm.totalCycle; }
-    uint32_t getLoopCycle() { return vgm.loopCycle; }
-
-    void seek(uint32_t cycle)
+    bool addWait(uint32_t wait)
     {
-        emu.scc->reset();
-        emu.psg->reset();
-        vgm.end = false;
-        vgm.cursor = vgm.head;
-        vgm.currentCycle = 0;
-        vgm.loopCount = 0;
-        vgm.wait = 0;
-        while (execute(true) && vgm.currentCycle < cycle) {
-            vgm.wait = 0;
+        while (wait) {
+            // the loop point must stay at the head of an event, so never merge a wait across it
+            if (!eventCount || loopIndex == eventCount || events[eventCount - 1].wait == 0xFFFF) {
+                if (!addEvent(EV_Wait, 0, 0)) {
+                    return false;
+                }
+            }
+            Event* e = &events[eventCount - 1];
+            uint32_t n = 0xFFFF - e->wait;
+            n = wait < n ? wait : n;
+            e->wait += n;
+            wait -= n;
         }
+        return true;
     }
 
-  private:
-    bool execute(bool emulation)
+    bool compile(const uint8_t* data, size_t size, int head, int loopOffset)
     {
-        if (!vgm.data || vgm.end) {
+        if (head < 0x40 || (int)size <= head) {
             return false;
         }
-        while (vgm.wait < 1) {
-            if (vgm.loopOffset == vgm.cursor) {
-                vgm.loopCycle = vgm.currentCycle;
+        size_t cursor = head;
+        uint32_t cycle = 0;
+        bool succeeded = true;
+        while (succeeded) {
+            if (loopOffset && cursor == (size_t)loopOffset) {
+                loopIndex = eventCount;
+                loopCycle = cycle;
+            }
+            if (size <= cursor) {
+                succeeded = addEvent(EV_End, 0, 0); // unterminated data
+                break;
+            }
+            uint8_t cmd = data[cursor];
+            size_t length;
+            switch (cmd) {
+                case 0x31: length = 2; break;
+                case 0xA0: length = 3; break;
+                case 0xD2: length = 4; break;
+                case 0x61: length = 3; break;
+                default: length = 1;
+            }
+            if (size < cursor + length) {
+                succeeded = addEvent(EV_End, 0, 0); // truncated command
+                break;
             }
-            uint8_t cmd = vgm.data[vgm.cursor++];
+            const uint8_t* op = &data[cursor + 1];
+            cursor += length;
             switch (cmd) {
-                case 0x31: // AY-3-8910 stereo mask (ignore)
-                    vgm.cursor++;
-                    // emu.psg->setMask(vgm.data[vgm.cursor++]);
+                case 0x31:
+                    // AY-3-8910 stereo mask (bit 6: YM2203 SSG and bit 7: the second chip are not supported)
+                    if (!(op[0] & 0xC0)) {
+                        succeeded = addEvent(EV_Stereo, 0, op[0]);
+                    }
                     break;
-                case 0xA0: {
+                case 0xA0:
                     // AY-3-8910 reigster
-                    uint8_t addr = vgm.data[vgm.cursor++];
-                    uint8_t value = vgm.data[vgm.cursor++];
-                    if (emulation) {
-                        emu.psg->writeReg(addr, value);
+                    if (op[0] < 16) {
+                        succeeded = addEvent(EV_PSG, op[0], op[1]);
                     }
                     break;
-                }
                 case 0xD2: {
-                    // SCC1
-                    uint8_t port = vgm.data[vgm.cursor++] & 0x7F;
-                    uint8_t offset = vgm.data[vgm.cursor++];
-                    uint8_t data = vgm.data[vgm.cursor++];
-                    if (emulation) {
-                        switch (port) {
-                            case 0x00: emu.scc->write_waveform1(offset, data); break;
-                            case 0x01: emu.scc->write_frequency(offset, data); break;
-                            case 0x02: emu.scc->write_volume(offset, data); break;
-                            case 0x03: emu.scc->write_keyoff(data); break;
-                            case 0x04: emu.scc->write_waveform2(offset, data); break;
-                            case 0x05: emu.scc->write_test(data); break;
-                        }
+                    // SCC1: resolve the port to the register of EMU2212
+                    uint8_t offset = op[1];
+                    switch (op[0] & 0x7F) {
+                        case 0x00: succeeded = addEvent(EV_SCC, offset & 0x7F, op[2]); break;
+                        case 0x01: succeeded = addEvent(EV_SCC, (offset & 0x0F) | 0xC0, op[2]); break;
+                        case 0x02: succeeded = addEvent(EV_SCC, (offset & 0x0F) | 0xD0, op[2]); break;
+                        case 0x03: succeeded = addEvent(EV_SCC, 0xE1, op[2]); break;
+                        case 0x04: succeeded = addEvent(EV_SCC, (offset & 0x1F) | 0x60, op[2]); break;
+                        case 0x05: succeeded = addEvent(EV_SCC, 0xE2, op[2]); break;
                     }
                     break;
                 }
                 case 0x61: {
                     // Wait nn samples
                     unsigned short nn;
-                    memcpy(&nn, &vgm.data[vgm.cursor], 2);
-                    vgm.cursor += 2;
-                    vgm.wait += nn;
-                    vgm.currentCycle += nn;
+                    memcpy(&nn, op, 2);
+                    succeeded = addWait(nn);
+                    cycle += nn;
                     break;
                 }
                 case 0x62:
-                    vgm.wait += 735;
-                    vgm.currentCycle += 735;
+                    succeeded = addWait(735);
+                    cycle += 735;
                     break;
                 case 0x63:
-                    vgm.wait += 882;
-                    vgm.currentCycle += 882;
+                    succeeded = addWait(882);
+                    cycle += 882;
                     break;
-                case 0x66: {
+                case 0x66:
                     // End of sound data
-                    if (vgm.loopOffset) {
-                        vgm.loopCount++;
-                        vgm.cursor = vgm.loopOffset;
-                        vgm.totalCycle = vgm.currentCycle;
-                        vgm.currentCycle = vgm.loopCycle;
-                        return false;
-                    } else {
-                        vgm.totalCycle = vgm.currentCycle;
-                        vgm.end = true;
-                        return false;
-                    }
-                }
+                    totalCycle = cycle;
+                    return addEvent(EV_End, 0, 0);
 
                 case 0x70:
                 case 0x71:
@@ -1074,8 +3359,8 @@ class VgmDriver
                 case 0x7D:
                 case 0x7E:
                 case 0x7F:
-                    vgm.wait += cmd - 0x6F;
-                    vgm.currentCycle += cmd - 0x6F;
+                    succeeded = addWait(cmd - 0x6F);
+                    cycle += cmd - 0x6F;
                     break;
 
                 case 0xDD:
@@ -1089,12 +3374,2203 @@ class VgmDriver
 
                 default:
                     // Error: Detected an unsupported command
-                    vgm.end = true;
-                    return false;
+                    totalCycle = cycle;
+                    return addEvent(EV_Stop, 0, 0);
             }
         }
-        return true;
+        totalCycle = cycle;
+        return succeeded;
     }
 };
 
+/**
+ * VGM driver specialized for the chips and the sampling rate at compile time (VgmDriver is the generic one).
+ * The chips that are not compiled in are ignored (e.g., the PSG commands of a song for VgmChips::SCC),
+ * and Rate is the fixed sampling rate (0: the rate of the constructor).
+ */
+template <VgmChips Chips = VgmChips::All, int Rate = 0>
+class BasicVgmDriver
+{
+  private:
+    enum EmulatorType {
+        ET_PSG = 0,
+        ET_SCC,
+        ET_Length
+    };
+
+  public:
+    enum class SeekMode {
+        Emulation, // replay every command through the emulators (default)
+        Shadow,    // replay the commands into the shadow registers and apply the final image once
+    };
+
+    enum class LoopCacheMode {
+        Exact, // replay if the whole state of the chips is the same as the head of the loop (bit-exact, default)
+        Lossy, // replay if the registers and the wave RAM are the same, and crossfade the seams (the phases jump)
+    };
+
+  private:
+    // The chips are embedded, so that the driver can be constructed without the heap (e.g., in an arena)
+    struct Emulator {
+        EMU2149 psg;
+        EMU2212 scc;
+        Emulator(int rate) : psg(3579545, rate), scc(3579545, rate) {}
+    } emu;
+
+    typedef VgmSong::Event VgmEvent;
+
+    // Playback state of the song (loopIndex, loopCycle and totalCycle are copied from the song)
+    struct VgmContext {
+        uint32_t clocks[ET_Length]; // the clocks of the compiled chips
+        int cursor;
+        int loopIndex;
+        int wait;              // samples until the next command (at the output rate)
+        uint32_t waitFraction; // fraction of wait in 1/44100 samples
+        bool end;
+        uint32_t loopCount;
+        uint32_t loopCycle;
+        uint32_t currentCycle;
+        uint32_t totalCycle;
+    } vgm;
+
+    VgmSong ownSong;       // song compiled by load(data, size)
+    const VgmSong* song;   // the song of the playback (ownSong or a shared song)
+    const VgmEvent* events; // events of song
+    int eventCount;
+
+    // Snapshot of the seek state (chips and cursor) for VgmDriver::seek
+    struct Keyframe {
+        EMU2149::Context psg;
+        EMU2212::Context scc;
+        int cursor;
+        uint32_t currentCycle;
+    };
+
+    Keyframe* keyframes;
+    int keyframeCount;
+    uint32_t keyframeInterval;
+
+    // Register image of a command stream (seek in SeekMode::Shadow, the song and the sound effects of playSfx)
+    struct RegisterShadow {
+        uint8_t psg[16];
+        uint32_t psgWritten;
+        int8_t wave[5][32];
+        uint32_t waveWritten[5];
+        uint8_t scc[0x40];
+        uint64_t sccWritten;
+        uint8_t rotate;
+        bool mirror;
+        uint8_t cycle;        // cycle mode of the test register (bits 0-1) at this point
+        uint8_t freqCycle[5]; // cycle mode at the last frequency write of each SCC channel
+    };
+
+    SeekMode seekMode;
+
+    enum {
+        BlockSize = 256,
+        MinSegmentSize = 44100,   // renderParallel does not split the samples shorter than this
+        PassSize = 4096,          // max samples of a pass in the concurrent chips mode
+        PassWrites = 1024,        // max register writes of a chip in a pass
+        GainUnity = 1 << 30,      // gain level of x1.0 (Q30)
+        MaxSfx = 4,               // sound effects played at the same time
+        ShadowKeyframes = 441000, // keyframe interval of SeekMode::Shadow without setKeyframeInterval (10 sec)
+        MixScaleBits = 23,        // fraction bits of mixScale
+        MixScaleLimit = 51200,    // master volume whose mixScale fits 32 bits
+    };
+
+#if !defined(SCCVGM_NO_THREADS)
+    // Register writes of a chip demultiplexed from the events, and their sample position in the pass
+    struct ChipWrite {
+        int time;
+        uint8_t reg;
+        uint8_t value;
+    };
+
+    struct ChipLog {
+        ChipWrite writes[PassWrites];
+        int count;
+    };
+
+    // State of the concurrent chips mode: EMU2149 runs on the worker, EMU2212 runs on the caller of render
+    struct ChipPass {
+        ChipLog psg;
+        ChipLog scc;
+        int16_t psgBuffer[PassSize];
+        int16_t sccBuffer[PassSize];
+        int16_t* output; // buffer of render
+        int start;       // head of the pass in output
+        int time;        // current position in output
+        int length;      // length of the pass requested to the worker
+        std::atomic<uint32_t> request;
+        std::atomic<uint32_t> done;
+        std::atomic<bool> quit;
+        std::thread worker;
+    };
+
+    ChipPass* chipPass;
+#endif
+
+    alignas(64) int16_t psgBuffer[BlockSize];
+    alignas(64) int16_t sccBuffer[BlockSize];
+
+    int rate;
+    int masterVolume;
+    uint32_t mixScale; // masterVolume / 100 rounded up (Q23), and mixScaled if 0 <= masterVolume < MixScaleLimit
+    bool mixScaled;
+    short waveMax;
+    short waveMin;
+
+    // Output gain that ramps linearly to the target (Q30)
+    struct Gain {
+        int32_t level;
+        int32_t target;
+        int32_t step; // per sample
+        int ramp;     // samples until the level reaches the target
+    } gain;
+
+    int fadeLoops;    // loop count that starts the fade-out (0: disabled)
+    int fadeSamples;  // length of the fade-out
+    bool fading;      // the fade-out has started
+    int32_t fadeFrom; // gain before the fade-out (seek restores it)
+
+    // Channels shared by the song and the sound effects (the noise and the envelope of the PSG are channels too)
+    enum MixChannel {
+        MC_PSG = 0, // PSG channel A-C
+        MC_Noise = 3,
+        MC_Envelope,
+        MC_SCC, // SCC channel 0-4
+        MC_Length = MC_SCC + 5,
+    };
+
+    // Sound effect played over the song on the same chips (handle 0: free slot)
+    struct Sfx {
+        const VgmSong* song;
+        int cursor;
+        int wait;
+        uint32_t waitFraction;
+        int priority;
+        int handle;            // the newer sound effect has the larger handle
+        uint32_t claims;       // channels written by the sound effect (bit: MixChannel)
+        RegisterShadow shadow; // registers written by the sound effect
+    };
+
+    Sfx sfx[MaxSfx];
+    int sfxCount;               // playing sound effects
+    int sfxHandle;              // handle of the last sound effect
+    int8_t owners[MC_Length];   // sound effect that owns the channel (-1: the song)
+    RegisterShadow songShadow;  // registers written by the song while the sound effects play
+
+    // PCM of a loop of the song in the steady state, replayed instead of the emulation (setLoopCache)
+    struct LoopCache {
+        int16_t* psg;       // output of the chips from the head of the loop (capacity samples each)
+        int16_t* scc;
+        int16_t* psgTail;   // output of the chips after the loop (fade samples each, LoopCacheMode::Lossy)
+        int16_t* sccTail;
+        LoopCacheMode mode;
+        int capacity;       // max samples of the loop (0: disabled)
+        int fade;           // samples of the crossfade at the seams (LoopCacheMode::Lossy)
+        int length;         // recorded samples
+        int position;       // position of the replay (or the crossfade) in the loop
+        uint32_t loopCount; // loop count of the last loop point
+        bool recording;     // render records the output to the cache
+        bool seaming;       // render crossfades the emulation to the head of the cache, then replays it
+        bool replaying;     // render replays the cache (the chips are not emulated)
+        bool complete;      // the cache has a whole loop in the steady state
+
+        // state at the head of the cached loop (the loop point before its commands), the emulation resumes from it
+        RegisterShadow registers;
+        EMU2149::State psgState;
+        EMU2212::State sccState;
+        EMU2149::Context psgContext;
+        EMU2212::Context sccContext;
+        int cursor;
+        int wait;
+        uint32_t waitFraction;
+        uint32_t currentCycle;
+        RegisterShadow writes; // commands of the song in the replay (discarded)
+    } loopCache;
+
+  public:
+    /**
+     * rate is the sampling rate of the output (e.g., 44100, 48000 or 96000).
+     * The cycles of the API (seek, getCurrentCycle, etc.) are 44100Hz as VGM regardless of the rate.
+     */
+    BasicVgmDriver(int rate = Rate ? Rate : 44100) : emu(Rate ? Rate : rate)
+    {
+        this->rate = Rate ? Rate : rate;
+        song = NULL;
+        events = NULL;
+        eventCount = 0;
+#if !defined(SCCVGM_NO_THREADS)
+        chipPass = NULL;
+#endif
+        keyframes = NULL;
+        keyframeCount = 0;
+        keyframeInterval = 0;
+        seekMode = SeekMode::Emulation;
+        this->setMasterVolume(600);
+        fadeLoops = 0;
+        fadeSamples = 0;
+        sfxHandle = 0;
+        memset(sfx, 0, sizeof(sfx));
+        memset(&loopCache, 0, sizeof(loopCache));
+        this->setWaveSize(95);
+        this->reset();
+    }
+
+    ~BasicVgmDriver()
+    {
+        setConcurrentChips(false);
+        free(keyframes);
+        free(loopCache.psg);
+    }
+
+    // A driver owns its song, keyframes, loop cache and worker: share a VgmSong with load(const VgmSong*) instead
+    BasicVgmDriver(const BasicVgmDriver&) = delete;
+    BasicVgmDriver& operator=(const BasicVgmDriver&) = delete;
+
+    void setMasterVolume(int masterVolume)
+    {
+        this->masterVolume = masterVolume;
+        // |w| * mixScale >> 23 truncates as |w| * masterVolume / 100 for |w| <= 65536: the error is below 1 / 128
+        mixScaled = 0 <= masterVolume && masterVolume < MixScaleLimit;
+        mixScale = mixScaled ? (uint32_t)((((uint64_t)masterVolume << MixScaleBits) + 99) / 100) : 0;
+    }
+
+    void setWaveSize(int waveSizeInPercent)
+    {
+        if (waveSizeInPercent < 0) {
+            waveSizeInPercent = 0;
+        } else if (100 < waveSizeInPercent) {
+            waveSizeInPercent = 100;
+        }
+        this->waveMax = (short)((32767 * waveSizeInPercent) / 100);
+        this->waveMin = (short)((-32768 * waveSizeInPercent) / 100);
+    }
+
+    /**
+     * Ramp the gain of the output to the target (0 to 32768: x0.0 to x1.0) linearly in the samples (0: at once).
+     * The gain is applied after the master volume and the clamp in the mix of render, renderStereo and renderStems,
+     * so it does not cost an extra pass. load resets the gain to x1.0.
+     */
+    void setGain(int target, int rampSamples = 0)
+    {
+        target = target < 0 ? 0 : (32768 < target ? 32768 : target);
+        gain.target = target << 15;
+        if (rampSamples < 1) {
+            gain.level = gain.target;
+            gain.step = 0;
+            gain.ramp = 0;
+        } else {
+            gain.step = (gain.target - gain.level) / rampSamples;
+            gain.ramp = rampSamples;
+        }
+    }
+
+    int getGain() { return gain.level >> 15; }
+
+    /**
+     * Fade out in the samples when the playback reaches the loop point for the loops-th time (0: disabled),
+     * and stop the playback (isPlaying returns false) at the end of the fade-out.
+     */
+    void setFadeOut(int loops, int samples)
+    {
+        fadeLoops = loops;
+        fadeSamples = samples;
+    }
+
+    bool isFading() { return fading; }
+
+    /**
+     * The VGM commands are compiled into the internal event stream at load.
+     * If keepData is false, the driver does not keep any reference to data after load,
+     * so the caller can release it immediately.
+     */
+    bool load(const uint8_t* data, size_t size, bool keepData = true)
+    {
+        this->reset();
+        if (!ownSong.load(data, size, keepData)) {
+            return false;
+        }
+        return attach(&ownSong);
+    }
+
+    /**
+     * Play a song compiled by VgmSong::load without compiling it again (the song is shared, not copied).
+     * The song must outlive the playback of the driver, and must not be loaded again meanwhile.
+     */
+    bool load(const VgmSong* song)
+    {
+        this->reset();
+        if (!song || !song->events) {
+            return false;
+        }
+        return attach(song);
+    }
+
+    /**
+     * Play a sound effect over the song on the same chips, and return its handle (0: no slot for the priority).
+     * A sound effect takes the channels it writes (PSG A-C, noise, envelope and SCC 0-4) from the song and from
+     * the sound effects of a lower priority (or the older ones of the same priority), and the writes of the others
+     * to the taken channels only update their shadow registers. When the sound effect ends (or stopSfx),
+     * its channels return to the next owners with their registers. When all MaxSfx slots are playing,
+     * the sound effect replaces the lowest one of the same or a lower priority.
+     * The song of the sound effect must outlive the playback (it is shared, not copied), and its loop repeats
+     * until stopSfx. seek, load and loadState stop the sound effects.
+     */
+    int playSfx(const VgmSong* song, int priority = 1)
+    {
+        bool psg = HasPSG && song && song->events && song->clockPSG;
+        bool scc = HasSCC && song && song->events && song->clockSCC;
+        if (!psg && !scc) {
+            return 0;
+        }
+        int index = -1;
+        for (int i = 0; i < MaxSfx; i++) {
+            if (!sfx[i].handle) {
+                index = i;
+                break;
+            }
+            if (sfx[i].priority <= priority && (index < 0 || outranks(index, i))) {
+                index = i;
+            }
+        }
+        if (index < 0) {
+            return 0;
+        }
+        leaveLoopCache();
+        if (sfx[index].handle) {
+            releaseSfx(index);
+        }
+        if (!sfxCount) {
+            captureShadow(&songShadow);
+        }
+        // the chips that the song does not use start to render for the sound effect
+        if ((psg && !vgm.clocks[ET_PSG]) || (scc && !vgm.clocks[ET_SCC])) {
+            vgm.clocks[ET_PSG] = vgm.clocks[ET_PSG] ? vgm.clocks[ET_PSG] : (psg ? song->clockPSG : 0);
+            vgm.clocks[ET_SCC] = vgm.clocks[ET_SCC] ? vgm.clocks[ET_SCC] : (scc ? song->clockSCC : 0);
+            setupChips();
+        }
+        Sfx* s = &sfx[index];
+        s->song = song;
+        s->cursor = 0;
+        s->wait = 0;
+        s->waitFraction = 0;
+        s->priority = priority;
+        s->handle = ++sfxHandle;
+        s->claims = 0;
+        beginShadow(&s->shadow);
+        sfxCount++;
+        return s->handle;
+    }
+
+    // Stop the sound effect, and return its channels to the next owners
+    void stopSfx(int handle)
+    {
+        for (int i = 0; i < MaxSfx; i++) {
+            if (handle && handle == sfx[i].handle) {
+                releaseSfx(i);
+            }
+        }
+    }
+
+    void stopAllSfx()
+    {
+        for (int i = 0; i < MaxSfx; i++) {
+            if (sfx[i].handle) {
+                releaseSfx(i);
+            }
+        }
+    }
+
+    bool isSfxPlaying(int handle)
+    {
+        for (int i = 0; i < MaxSfx; i++) {
+            if (handle && handle == sfx[i].handle) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Capture a keyframe every `cycles` (44100Hz) so that seek only replays the commands after the nearest one.
+     * Each keyframe costs sizeof(EMU2149::Context) + sizeof(EMU2212::Context) bytes (about 700 bytes),
+     * so the smaller interval makes seek faster and uses more memory. 0 disables the keyframes (default), except that
+     * SeekMode::Shadow captures one every 10 sec then.
+     * Returns false if the keyframes can not be allocated (seek then replays from the head).
+     */
+    bool setKeyframeInterval(uint32_t cycles)
+    {
+        uint32_t previous = getKeyframeCycles();
+        keyframeInterval = cycles;
+        return getKeyframeCycles() == previous || buildKeyframes();
+    }
+
+    /**
+     * Replay the loop of the song from a PCM cache of up to maxSamples (0: disabled, default) instead of the emulation.
+     * render records a loop, and replays it from the next loop point if the chips are in the state of the head of
+     * the recorded loop (the steady state), so a looping song costs only the mix. The commands still advance the
+     * playback (getCurrentCycle, getLoopCount and the fade-out) as the emulation does.
+     * LoopCacheMode::Exact compares the whole state of the chips, so the replay is bit-exact with the emulation, and
+     * it needs the exact engines of renderParallel (EMU2149::Engine::Tick/Event and EMU2212::Engine::Scalar/Simd).
+     * The free-running counters (the phases, the noise and the envelope) rarely come back to the same state, so
+     * LoopCacheMode::Lossy compares only the registers and the wave RAM, and crossfades the seams (10ms) where the
+     * phases jump. The cache costs maxSamples * 4 bytes.
+     * renderStereo, renderStems, renderParallel, saveState and playSfx resume the emulation from the head of
+     * the loop before they run (this costs a skip of the replayed samples), and seek and loadState stop the replay
+     * until the next loop point. Returns false if the cache can not be allocated (the cache is disabled).
+     */
+    bool setLoopCache(int maxSamples, LoopCacheMode mode = LoopCacheMode::Exact)
+    {
+        dropLoopCache();
+        free(loopCache.psg);
+        loopCache.psg = NULL;
+        loopCache.scc = NULL;
+        loopCache.psgTail = NULL;
+        loopCache.sccTail = NULL;
+        loopCache.mode = mode;
+        loopCache.capacity = 0;
+        loopCache.fade = 0;
+        if (maxSamples < 1) {
+            return true;
+        }
+        int fade = LoopCacheMode::Lossy == mode ? getRate() / 100 : 0;
+        int16_t* psg = (int16_t*)malloc(((size_t)maxSamples + fade) * 2 * sizeof(int16_t));
+        if (!psg) {
+            return false;
+        }
+        loopCache.psg = psg;
+        loopCache.scc = &psg[maxSamples];
+        loopCache.psgTail = &psg[maxSamples * 2];
+        loopCache.sccTail = &psg[maxSamples * 2 + fade];
+        loopCache.capacity = maxSamples;
+        loopCache.fade = fade;
+        return true;
+    }
+
+    bool isLoopCached() { return loopCache.replaying; }
+
+    void reset()
+    {
+        free(keyframes);
+        keyframes = NULL;
+        keyframeCount = 0;
+        ownSong.clear();
+        song = NULL;
+        events = NULL;
+        eventCount = 0;
+        memset(&vgm, 0, sizeof(vgm));
+        vgm.loopIndex = -1;
+        gain.level = GainUnity;
+        gain.target = GainUnity;
+        gain.step = 0;
+        gain.ramp = 0;
+        fading = false;
+        clearSfx();
+        emu.psg.reset();
+        emu.scc.reset();
+        stopLoopCache();
+        loopCache.complete = false;
+    }
+
+    void render(int16_t* buf, int samples)
+    {
+        if (!events && !sfxCount) {
+            memset(buf, 0, samples * 2);
+            return;
+        }
+#if !defined(SCCVGM_NO_THREADS)
+        if (chipPass && usePSG() && useSCC() && !sfxCount && !loopCache.replaying) {
+            leaveLoopCache();
+            renderConcurrent(buf, samples);
+            loopCache.loopCount = vgm.loopCount;
+            return;
+        }
+#endif
+        int cursor = 0;
+        while (cursor < samples) {
+            // render the whole span until the next command (at least 1 sample)
+            int span = this->nextSpan(samples - cursor, true);
+            if (loopCache.replaying) {
+                replayLoop(&buf[cursor], span);
+            } else {
+                this->renderSpan(&buf[cursor], span);
+            }
+            cursor += span;
+        }
+    }
+
+    /**
+     * Render the interleaved left and right samples (buf has samples * 2 elements) with the pans of the channels
+     * (setPanPSG, setPanSCC and the AY-3-8910 stereo mask of VGM), as int16_t or float (-1.0 to 1.0).
+     */
+    void renderStereo(int16_t* buf, int samples) { renderStereo<int16_t>(buf, samples); }
+    void renderStereo(float* buf, int samples) { renderStereo<float>(buf, samples); }
+
+    /**
+     * Render the output of each channel to the planar buffers in a single pass: stems[0-2] are the PSG channels A-C
+     * and stems[3-7] are the SCC channels 1-5 (NULL skips the channel), and buf is the mixed output of render
+     * (NULL skips it). The stems are scaled by the master volume and clamped to the wave size as the mixed output.
+     * The stems are rendered by the selected engines, so they add up to the mixed output of the same engines.
+     */
+    void renderStems(int16_t* const* stems, int16_t* buf, int samples)
+    {
+        if (!events && !sfxCount) {
+            for (int i = 0; i < 8; i++) {
+                if (stems[i]) {
+                    memset(stems[i], 0, samples * 2);
+                }
+            }
+            if (buf) {
+                memset(buf, 0, samples * 2);
+            }
+            return;
+        }
+        leaveLoopCache();
+        int16_t* heads[8];
+        int cursor = 0;
+        while (cursor < samples) {
+            int span = this->nextSpan(samples - cursor);
+            for (int i = 0; i < 8; i++) {
+                heads[i] = stems[i] ? &stems[i][cursor] : NULL;
+            }
+            this->renderSpanStems(heads, buf ? &buf[cursor] : NULL, span);
+            cursor += span;
+        }
+    }
+
+    // Gains of a channel to the left and right of renderStereo (0 to 256, default 256 for both)
+    void setPanPSG(int ch, int left, int right) { emu.psg.setPan(ch, left, right); }
+    void setPanSCC(int ch, int left, int right) { emu.scc.setPan(ch, left, right); }
+
+    /**
+     * Render the samples split into time segments on the threads (0: the number of the CPU cores).
+     * The head state of each segment is reached by skipping the emulation without the output, so the output
+     * and the state after the call are bit-identical to render.
+     * The skip is exact with EMU2149::Engine::Tick/Event and EMU2212::Engine::Scalar/Simd only,
+     * so the other engines (and the short renders) are rendered sequentially.
+     */
+    void renderParallel(int16_t* buf, int samples, int threads = 0)
+    {
+#if defined(SCCVGM_NO_THREADS)
+        render(buf, samples);
+#else
+        if (threads < 1) {
+            threads = (int)std::thread::hardware_concurrency();
+        }
+        int segments = samples / MinSegmentSize;
+        segments = threads < segments ? threads : segments;
+        if (segments < 2 || !events || sfxCount || !isSkippable()) {
+            render(buf, samples);
+            return;
+        }
+        leaveLoopCache();
+        int length = samples / segments;
+        BasicVgmDriver** drivers = new BasicVgmDriver*[segments - 1];
+        std::thread* workers = new std::thread[segments - 1];
+        for (int i = 0; i < segments - 1; i++) {
+            // start a worker from the current state, then skip this driver to the next segment
+            BasicVgmDriver* driver = new BasicVgmDriver(rate);
+            int16_t* head = &buf[i * length];
+            driver->fork(this);
+            drivers[i] = driver;
+            workers[i] = std::thread([driver, head, length]() { driver->render(head, length); });
+            skip(length);
+        }
+        render(&buf[(segments - 1) * length], samples - (segments - 1) * length);
+        for (int i = 0; i < segments - 1; i++) {
+            workers[i].join();
+            delete drivers[i];
+        }
+        delete[] workers;
+        delete[] drivers;
+#endif
+    }
+
+    /**
+     * Render EMU2149 on a worker thread while EMU2212 renders on the caller of render (disabled by default).
+     * render demultiplexes the commands into the register writes of each chip, then both chips render
+     * the pass (up to 4096 samples) concurrently, and the results are mixed. The output is bit-identical.
+     * The worker and the buffers are allocated here, so render does not allocate nor lock in this mode.
+     * This pays off when both chips are heavy (e.g., high sampling rates) and a spare core is available.
+     */
+    void setConcurrentChips(bool enable)
+    {
+#if !defined(SCCVGM_NO_THREADS)
+        if (enable && !chipPass) {
+            chipPass = new ChipPass();
+            chipPass->request = 0;
+            chipPass->done = 0;
+            chipPass->quit = false;
+            chipPass->worker = std::thread([this]() { chipWorker(); });
+        } else if (!enable && chipPass) {
+            chipPass->quit.store(true, std::memory_order_release);
+            chipPass->worker.join();
+            delete chipPass;
+            chipPass = NULL;
+        }
+#endif
+    }
+
+    bool isPlaying() { return !vgm.end; }
+    uint32_t getLoopCount() { return vgm.loopCount; }
+    uint32_t getFrequencyPSG(int ch) { return emu.psg.getFrequency(ch); }
+    uint32_t getFrequencySCC(int ch) { return emu.scc.getFrequency(ch); }
+    void setEnginePSG(EMU2149::Engine engine)
+    {
+        dropLoopCache();
+        emu.psg.setEngine(engine);
+    }
+
+    void setEngineSCC(EMU2212::Engine engine)
+    {
+        dropLoopCache();
+        emu.scc.setEngine(engine);
+    }
+
+    /**
+     * Decimate both chips with the polyphase FIR of the quality (EMU2149::Engine::Fir and EMU2212::Engine::Fir).
+     * The cost per output sample is a dot product of 9 taps per tick of an output sample at Low (e.g., 370 taps for
+     * the SCC at 44100Hz), x2 at Medium and x4 at High.
+     */
+    void setDecimator(Decimator::Quality quality)
+    {
+        dropLoopCache();
+        emu.psg.setFirQuality(quality);
+        emu.scc.setFirQuality(quality);
+        emu.psg.setEngine(EMU2149::Engine::Fir);
+        emu.scc.setEngine(EMU2212::Engine::Fir);
+    }
+    int getRate() { return Rate ? Rate : rate; }
+    uint32_t getCurrentCycle() { return vgm.currentCycle; }
+    uint32_t getLengthCycle() { return vgm.totalCycle; }
+    uint32_t getLoopCycle() { return vgm.loopCycle; }
+    const uint8_t* getData() { return song ? song->getData() : NULL; }
+    size_t getDataSize() { return song ? song->getDataSize() : 0; }
+
+    /**
+     * SeekMode::Shadow also captures a keyframe every 10 sec (about 40KB for a 10 min song) unless setKeyframeInterval
+     * is set, so that seek replays at most 10 sec of the commands: a few dozen microseconds on any song length.
+     * Returns false if the keyframes can not be allocated (seek then replays from the head).
+     */
+    bool setSeekMode(SeekMode mode)
+    {
+        uint32_t previous = getKeyframeCycles();
+        seekMode = mode;
+        return getKeyframeCycles() == previous || buildKeyframes();
+    }
+
+    void seek(uint32_t cycle)
+    {
+        clearSfx();
+        if (fading) {
+            fading = false;
+            setGain(fadeFrom); // the fade-out starts again at the next loop
+        }
+        const Keyframe* key = findKeyframe(cycle);
+        if (key) {
+            emu.psg.loadContext(&key->psg);
+            emu.scc.loadContext(&key->scc);
+            vgm.cursor = key->cursor;
+            vgm.currentCycle = key->currentCycle;
+        } else {
+            emu.scc.reset();
+            emu.psg.reset();
+            vgm.cursor = 0;
+            vgm.currentCycle = 0;
+        }
+        vgm.end = false;
+        vgm.loopCount = 0;
+        vgm.wait = 0;
+        vgm.waitFraction = 0;
+        if (SeekMode::Shadow == seekMode) {
+            RegisterShadow shadow;
+            beginShadow(&shadow);
+            while (execute(&shadow) && vgm.currentCycle <= cycle) {
+                vgm.wait = 0;
+            }
+            applyShadow(&shadow);
+        } else {
+            while (execute() && vgm.currentCycle <= cycle) {
+                vgm.wait = 0;
+            }
+        }
+        // start playback exactly at the requested cycle
+        if (!vgm.end && cycle < vgm.currentCycle) {
+            uint64_t remain = (uint64_t)(vgm.currentCycle - cycle) * getRate();
+            if ((int)(remain / 44100) <= vgm.wait) {
+                vgm.wait = (int)(remain / 44100);
+                vgm.waitFraction = (uint32_t)(remain % 44100);
+            }
+        }
+        stopLoopCache();
+    }
+
+    enum {
+        StateVersion = 2,
+    };
+
+    /**
+     * Playback state of saveState and loadState: a fixed-size plain struct of fixed-width fields without padding,
+     * so it can be copied with memcpy and stored as is (in the byte order of the host).
+     * It has the cursor of the song, the gain, and the chips (counters, noise LFSR, envelope and wave RAM).
+     * The settings (master volume, pans, engines and setFadeOut) are not included.
+     */
+    struct State {
+        uint32_t version;      // StateVersion
+        uint32_t size;         // sizeof(State)
+        uint32_t rate;         // sampling rate of the driver
+        uint32_t eventCount;   // the song of the state (loadState rejects the state of another song)
+        uint32_t totalCycle;   // ditto
+        int32_t cursor;        // index of the next event
+        int32_t wait;          // samples until the next event
+        uint32_t waitFraction; // fraction of wait in 1/44100 samples
+        uint32_t loopCount;
+        uint32_t currentCycle;
+        int32_t gainLevel;
+        int32_t gainTarget;
+        int32_t gainStep;
+        int32_t gainRamp;
+        int32_t fadeFrom;
+        uint8_t end;
+        uint8_t fading;
+        uint8_t reserved[2];
+        EMU2149::State psg;
+        EMU2212::State scc;
+    };
+    static_assert(sizeof(State) == 572, "BasicVgmDriver::State must not have padding");
+
+    // Save the playback state (572 bytes without allocation, cheap enough to call every frame)
+    void saveState(State* state)
+    {
+        leaveLoopCache();
+        memset(state, 0, sizeof(State));
+        state->version = StateVersion;
+        state->size = sizeof(State);
+        state->rate = getRate();
+        state->eventCount = eventCount;
+        state->totalCycle = vgm.totalCycle;
+        state->cursor = vgm.cursor;
+        state->wait = vgm.wait;
+        state->waitFraction = vgm.waitFraction;
+        state->loopCount = vgm.loopCount;
+        state->currentCycle = vgm.currentCycle;
+        state->gainLevel = gain.level;
+        state->gainTarget = gain.target;
+        state->gainStep = gain.step;
+        state->gainRamp = gain.ramp;
+        state->fadeFrom = fadeFrom;
+        state->end = vgm.end ? 1 : 0;
+        state->fading = fading ? 1 : 0;
+        emu.psg.saveState(&state->psg);
+        emu.scc.saveState(&state->scc);
+    }
+
+    /**
+     * Restore the playback state saved by saveState, and the rendering continues as after saveState
+     * (bit-exact except EMU2149::Engine::Blep/Fir and EMU2212::Engine::Fir, which restart their filters).
+     * It returns false without any change if the state is of another version, sampling rate or song, or has a value
+     * out of range (e.g., a corrupt save).
+     */
+    bool loadState(const State* state)
+    {
+        if (StateVersion != state->version || sizeof(State) != state->size || (uint32_t)getRate() != state->rate) {
+            return false;
+        }
+        if (!events || (uint32_t)eventCount != state->eventCount || vgm.totalCycle != state->totalCycle) {
+            return false;
+        }
+        if (state->cursor < 0 || eventCount < state->cursor || (eventCount == state->cursor && !state->end) || 44100 <= state->waitFraction) {
+            return false; // the cursor at the end of the events only after the end
+        }
+        if (state->gainRamp < 0 || 1 < state->end || 1 < state->fading || state->reserved[0] || state->reserved[1]) {
+            return false;
+        }
+        // the gain stays in x0.0 to x1.0 throughout the ramp (so the mix does not overflow)
+        int64_t rampEnd = (int64_t)state->gainLevel + (int64_t)state->gainStep * state->gainRamp;
+        if (state->gainLevel < 0 || GainUnity < state->gainLevel || state->gainTarget < 0 || GainUnity < state->gainTarget) {
+            return false;
+        }
+        if (rampEnd < 0 || GainUnity < rampEnd || (!state->gainRamp && state->gainStep) || state->fadeFrom < 0 || 32768 < state->fadeFrom) {
+            return false;
+        }
+        if (!emu.psg.verifyState(&state->psg) || !emu.scc.verifyState(&state->scc)) {
+            return false;
+        }
+        clearSfx();
+        vgm.cursor = state->cursor;
+        vgm.wait = state->wait;
+        vgm.waitFraction = state->waitFraction;
+        vgm.loopCount = state->loopCount;
+        vgm.currentCycle = state->currentCycle;
+        vgm.end = 0 != state->end;
+        gain.level = state->gainLevel;
+        gain.target = state->gainTarget;
+        gain.step = state->gainStep;
+        gain.ramp = state->gainRamp;
+        fadeFrom = state->fadeFrom;
+        fading = 0 != state->fading;
+        emu.psg.loadState(&state->psg);
+        emu.scc.loadState(&state->scc);
+        stopLoopCache();
+        return true;
+    }
+
+  private:
+    // Start the playback of the song (the chips of the song that are not compiled in are ignored)
+    bool attach(const VgmSong* song)
+    {
+        vgm.clocks[ET_PSG] = HasPSG ? song->clockPSG : 0;
+        vgm.clocks[ET_SCC] = HasSCC ? song->clockSCC : 0;
+        if (!vgm.clocks[ET_PSG] && !vgm.clocks[ET_SCC]) {
+            this->reset();
+            return false;
+        }
+        setupChips();
+        this->song = song;
+        events = song->events;
+        eventCount = song->eventCount;
+        vgm.loopIndex = song->loopIndex;
+        vgm.loopCycle = song->loopCycle;
+        vgm.totalCycle = song->totalCycle;
+        if (!buildKeyframes()) {
+            this->reset();
+            return false;
+        }
+        return true;
+    }
+
+    // The settings of the chips for VGM (they are not included in the contexts)
+    void setupChips()
+    {
+        if (vgm.clocks[ET_PSG]) {
+            emu.psg.setVolumeMode(2);
+            emu.psg.setClockDivider(1);
+        }
+        if (vgm.clocks[ET_SCC]) {
+            emu.scc.set_type(EMU2212::Type::Standard);
+        }
+    }
+
+    static const bool HasPSG = 0 != ((int)Chips & (int)VgmChips::PSG);
+    static const bool HasSCC = 0 != ((int)Chips & (int)VgmChips::SCC);
+
+    // The chips that render the song (constant unless both chips are compiled in)
+    inline bool usePSG() { return VgmChips::PSG == Chips || (HasPSG && vgm.clocks[ET_PSG]); }
+    inline bool useSCC() { return VgmChips::SCC == Chips || (HasSCC && vgm.clocks[ET_SCC]); }
+
+    bool isSkippable()
+    {
+        EMU2149::Engine psg = emu.psg.getEngine();
+        EMU2212::Engine scc = emu.scc.getEngine();
+        bool psgSkippable = EMU2149::Engine::Tick == psg || EMU2149::Engine::Event == psg;
+        bool sccSkippable = EMU2212::Engine::Scalar == scc || EMU2212::Engine::Simd == scc;
+        return (psgSkippable || !usePSG()) && (sccSkippable || !useSCC());
+    }
+
+    // Copy the playback state of the parent (the events are shared with the parent while it is alive)
+    void fork(BasicVgmDriver* parent)
+    {
+        EMU2149::Context psg;
+        EMU2212::Context scc;
+        reset();
+        vgm = parent->vgm;
+        song = parent->song;
+        events = parent->events;
+        eventCount = parent->eventCount;
+        setupChips();
+        parent->emu.psg.saveContext(&psg);
+        parent->emu.scc.saveContext(&scc);
+        emu.psg.loadContext(&psg);
+        emu.scc.loadContext(&scc);
+        emu.psg.setEngine(parent->emu.psg.getEngine());
+        emu.scc.setEngine(parent->emu.scc.getEngine());
+        masterVolume = parent->masterVolume;
+        mixScale = parent->mixScale;
+        mixScaled = parent->mixScaled;
+        waveMax = parent->waveMax;
+        waveMin = parent->waveMin;
+        gain = parent->gain;
+        fadeLoops = parent->fadeLoops;
+        fadeSamples = parent->fadeSamples;
+        fading = parent->fading;
+        fadeFrom = parent->fadeFrom;
+    }
+
+    // Advance the playback as render does, without the output
+    void skip(int samples)
+    {
+        int cursor = 0;
+        while (cursor < samples) {
+            int span = this->nextSpan(samples - cursor);
+            if (usePSG()) {
+                emu.psg.skip(span);
+            }
+            if (useSCC()) {
+                emu.scc.skip(span);
+            }
+            advanceGain(span);
+            cursor += span;
+        }
+    }
+
+    // The interval of the keyframes (0: none)
+    inline uint32_t getKeyframeCycles()
+    {
+        return keyframeInterval || SeekMode::Shadow != seekMode ? keyframeInterval : ShadowKeyframes;
+    }
+
+    // false: out of memory (no keyframes)
+    bool buildKeyframes()
+    {
+        free(keyframes);
+        keyframes = NULL;
+        keyframeCount = 0;
+        uint32_t interval = getKeyframeCycles();
+        if (!events || !interval) {
+            return true;
+        }
+        int capacity = (int)(vgm.totalCycle / interval) + 1;
+        keyframes = (Keyframe*)malloc(capacity * sizeof(Keyframe));
+        if (!keyframes) {
+            return false;
+        }
+
+        // replay the commands as seek does (directly to the chips), and take a snapshot at every interval
+        EMU2149::Context psg;
+        EMU2212::Context scc;
+        VgmContext ctx = vgm;
+        int playingSfx = sfxCount;
+        sfxCount = 0;
+        emu.psg.saveContext(&psg);
+        emu.scc.saveContext(&scc);
+        emu.psg.reset();
+        emu.scc.reset();
+        vgm.end = false;
+        vgm.cursor = 0;
+        vgm.currentCycle = 0;
+        vgm.wait = 0;
+        uint32_t next = interval;
+        while (execute()) {
+            if (next <= vgm.currentCycle && keyframeCount < capacity) {
+                Keyframe* key = &keyframes[keyframeCount++];
+                emu.psg.saveContext(&key->psg);
+                emu.scc.saveContext(&key->scc);
+                key->cursor = vgm.cursor;
+                key->currentCycle = vgm.currentCycle;
+                next = (vgm.currentCycle / interval + 1) * interval;
+            }
+            vgm.wait = 0;
+        }
+        vgm = ctx;
+        sfxCount = playingSfx;
+        emu.psg.loadContext(&psg);
+        emu.scc.loadContext(&scc);
+        return true;
+    }
+
+    const Keyframe* findKeyframe(uint32_t cycle)
+    {
+        // the last keyframe at or before the cycle
+        int left = 0;
+        int right = keyframeCount;
+        while (left < right) {
+            int mid = (left + right) / 2;
+            if (keyframes[mid].currentCycle <= cycle) {
+                left = mid + 1;
+            } else {
+                right = mid;
+            }
+        }
+        return left ? &keyframes[left - 1] : NULL;
+    }
+
+    void beginShadow(RegisterShadow* shadow)
+    {
+        memset(shadow, 0, sizeof(RegisterShadow));
+        uint8_t test = (uint8_t)emu.scc.readReg(0xE2);
+        shadow->rotate = (test & 0x40) ? 0x1F : 0;
+        shadow->rotate |= (test & 0x80) ? 0x18 : 0;
+        shadow->mirror = !(emu.scc.readReg(0xE0) & 1);
+        shadow->cycle = test & 3;
+        memset(shadow->freqCycle, shadow->cycle, sizeof(shadow->freqCycle));
+    }
+
+    inline void writeShadowPSG(RegisterShadow* shadow, uint8_t reg, uint8_t value)
+    {
+        shadow->psg[reg] = value;
+        shadow->psgWritten |= 1 << reg;
+    }
+
+    inline void writeShadowSCC(RegisterShadow* shadow, uint8_t reg, uint8_t value)
+    {
+        if (reg < 0xA0) {
+            // wave RAM is write-protected while rotating, and channel 4 shares channel 3's in the standard mode
+            int ch = reg >> 5;
+            if (!(shadow->rotate & (1 << ch))) {
+                shadow->wave[ch][reg & 0x1F] = (int8_t)value;
+                shadow->waveWritten[ch] |= 1 << (reg & 0x1F);
+                if (3 == ch && shadow->mirror) {
+                    shadow->wave[4][reg & 0x1F] = (int8_t)value;
+                    shadow->waveWritten[4] |= 1 << (reg & 0x1F);
+                }
+            }
+        } else if (0xC0 <= reg) {
+            shadow->scc[reg - 0xC0] = value;
+            shadow->sccWritten |= (uint64_t)1 << (reg - 0xC0);
+            if (reg <= 0xC9) {
+                shadow->freqCycle[(reg & 0x0F) >> 1] = shadow->cycle;
+            } else if (0xE2 == reg) {
+                shadow->rotate = (value & 0x40) ? 0x1F : 0;
+                shadow->rotate |= (value & 0x80) ? 0x18 : 0;
+                shadow->cycle = value & 3;
+            }
+        }
+    }
+
+    void applyShadow(const RegisterShadow* shadow)
+    {
+        int i, ch;
+        for (i = 0; i < 13; i++) {
+            if (shadow->psgWritten & (1 << i)) {
+                emu.psg.writeReg(i, shadow->psg[i]);
+            }
+        }
+        if (shadow->psgWritten & (1 << 13)) {
+            emu.psg.writeReg(13, shadow->psg[13]); // restart the envelope once
+        }
+
+        // the test register goes first, and each frequency is calculated with the cycle mode of its last write
+        uint8_t test = (uint8_t)emu.scc.readReg(0xE2);
+        if (shadow->sccWritten & ((uint64_t)1 << 0x22)) {
+            test = shadow->scc[0x22];
+        }
+        bool waveWritten = false;
+        for (ch = 0; ch < 5; ch++) {
+            waveWritten |= 0 != shadow->waveWritten[ch];
+        }
+        if (waveWritten) {
+            emu.scc.writeReg(0xE2, test & 0x3F);
+            for (ch = 0; ch < 5; ch++) {
+                for (i = 0; i < 32; i++) {
+                    if (shadow->waveWritten[ch] & (1 << i)) {
+                        emu.scc.writeReg(ch * 32 + i, (uint8_t)shadow->wave[ch][i]);
+                    }
+                }
+            }
+        }
+        if (waveWritten || (shadow->sccWritten & ((uint64_t)1 << 0x22))) {
+            emu.scc.writeReg(0xE2, test);
+        }
+        for (ch = 0; ch < 5; ch++) {
+            restoreFrequency(shadow, ch, test);
+        }
+        for (i = 0x0A; i < 0x22; i++) {
+            if (shadow->sccWritten & ((uint64_t)1 << i)) {
+                emu.scc.writeReg(0xC0 + i, shadow->scc[i]);
+            }
+        }
+    }
+
+    // Write the frequency of the SCC channel with the cycle mode of its last write (test: the current test register)
+    void restoreFrequency(const RegisterShadow* shadow, int ch, uint8_t test)
+    {
+        if (!(shadow->sccWritten & ((uint64_t)3 << (ch * 2)))) {
+            return;
+        }
+        bool swap = (test & 3) != shadow->freqCycle[ch];
+        if (swap) {
+            emu.scc.writeReg(0xE2, (test & ~3) | shadow->freqCycle[ch]);
+        }
+        for (int i = ch * 2; i < ch * 2 + 2; i++) {
+            if (shadow->sccWritten & ((uint64_t)1 << i)) {
+                emu.scc.writeReg(0xC0 + i, shadow->scc[i]);
+            }
+        }
+        if (swap) {
+            emu.scc.writeReg(0xE2, test);
+        }
+    }
+
+    void renderSpan(int16_t* buf, int samples)
+    {
+        while (0 < samples) {
+            int n = samples < BlockSize ? samples : BlockSize;
+            if (usePSG()) {
+                emu.psg.calcBlock(psgBuffer, n);
+            } else {
+                memset(psgBuffer, 0, n * 2);
+            }
+            if (useSCC()) {
+                emu.scc.calcBlock(sccBuffer, n);
+            } else {
+                memset(sccBuffer, 0, n * 2);
+            }
+            if (loopCache.recording) {
+                recordLoop(n);
+            } else if (loopCache.seaming) {
+                seamLoop(n);
+            }
+            mix(buf, psgBuffer, sccBuffer, n);
+            advanceGain(n);
+            buf += n;
+            samples -= n;
+        }
+    }
+
+    template <typename T>
+    void renderStereo(T* buf, int samples)
+    {
+        if (!events && !sfxCount) {
+            memset(buf, 0, samples * 2 * sizeof(T));
+            return;
+        }
+        leaveLoopCache();
+        int cursor = 0;
+        while (cursor < samples) {
+            int span = this->nextSpan(samples - cursor);
+            this->renderSpanStereo(&buf[cursor * 2], span);
+            cursor += span;
+        }
+    }
+
+    template <typename T>
+    void renderSpanStereo(T* buf, int samples)
+    {
+        while (0 < samples) {
+            int n = samples < BlockSize / 2 ? samples : BlockSize / 2;
+            if (usePSG()) {
+                emu.psg.calcBlockStereo(psgBuffer, n);
+            } else {
+                memset(psgBuffer, 0, n * 4);
+            }
+            if (useSCC()) {
+                emu.scc.calcBlockStereo(sccBuffer, n);
+            } else {
+                memset(sccBuffer, 0, n * 4);
+            }
+            mix(buf, psgBuffer, sccBuffer, n * 2, 1);
+            advanceGain(n);
+            buf += n * 2;
+            samples -= n;
+        }
+    }
+
+    void renderSpanStems(int16_t** stems, int16_t* buf, int samples)
+    {
+        static const int16_t silence[BlockSize] = {0};
+        while (0 < samples) {
+            int n = samples < BlockSize ? samples : BlockSize;
+            if (usePSG()) {
+                emu.psg.calcBlockStems(&stems[0], psgBuffer, n);
+            } else {
+                memset(psgBuffer, 0, n * 2);
+                for (int i = 0; i < 3; i++) {
+                    if (stems[i]) {
+                        memset(stems[i], 0, n * 2);
+                    }
+                }
+            }
+            if (useSCC()) {
+                emu.scc.calcBlockStems(&stems[3], sccBuffer, n);
+            } else {
+                memset(sccBuffer, 0, n * 2);
+                for (int i = 3; i < 8; i++) {
+                    if (stems[i]) {
+                        memset(stems[i], 0, n * 2);
+                    }
+                }
+            }
+            if (buf) {
+                mix(buf, psgBuffer, sccBuffer, n);
+                buf += n;
+            }
+            for (int i = 0; i < 8; i++) {
+                if (stems[i]) {
+                    mix(stems[i], stems[i], silence, n); // in place
+                    stems[i] += n;
+                }
+            }
+            advanceGain(n);
+            samples -= n;
+        }
+    }
+
+    /**
+     * Mix with the master volume, clamp to the wave size and apply the gain (float is scaled to -1.0 to 1.0).
+     * shift is log2 of the interleaved channels of buf (the channels of a sample share the gain).
+     * The gain does not advance here, so the caller calls advanceGain after all mixes of the samples.
+     */
+    template <typename T>
+    inline void mix(T* buf, const int16_t* psg, const int16_t* scc, int samples, int shift = 0)
+    {
+        int ramp = samples;
+        if (gain.ramp < samples >> shift) {
+            ramp = gain.ramp << shift;
+        }
+        if (0 < ramp) {
+            mixGain(buf, psg, scc, ramp, gain.level, gain.step, shift);
+        }
+        if (ramp < samples) {
+            mixGain(&buf[ramp], &psg[ramp], &scc[ramp], samples - ramp, gain.target, 0, shift);
+        }
+    }
+
+    template <typename T>
+    inline void mixGain(T* buf, const int16_t* psg, const int16_t* scc, int samples, int32_t level, int32_t step, int shift)
+    {
+        int i = 0;
+#if defined(SCCVGM_AVX2)
+        if (mixScaled && EMU2212::isSimdSupported()) {
+            i = mixAVX2(buf, psg, scc, samples, level, step, shift);
+        }
+#endif
+        bool unity = GainUnity == level && !step;
+        for (; i < samples; i++) {
+            int w = psg[i] + scc[i];
+            if (mixScaled) {
+                int v = (int)(((uint64_t)(uint32_t)(w < 0 ? -w : w) * mixScale) >> MixScaleBits);
+                w = w < 0 ? -v : v;
+            } else {
+                w = (int)((int64_t)w * masterVolume / 100);
+            }
+            if (waveMax < w) {
+                w = waveMax;
+            } else if (w < waveMin) {
+                w = waveMin;
+            }
+            if (!unity) {
+                w = (w * ((level + step * (i >> shift)) >> 15)) >> 15;
+            }
+            store(&buf[i], w);
+        }
+    }
+
+    inline void advanceGain(int samples)
+    {
+        if (samples < gain.ramp) {
+            gain.level += gain.step * samples;
+            gain.ramp -= samples;
+            return;
+        }
+        gain.level = gain.target;
+        gain.step = 0;
+        gain.ramp = 0;
+        if (fading) {
+            vgm.end = true; // the fade-out is over
+        }
+    }
+
+    inline bool isFadeDue() { return fadeLoops && !fading && (uint32_t)fadeLoops <= vgm.loopCount; }
+
+    void startFade()
+    {
+        fading = true;
+        fadeFrom = gain.target >> 15;
+        setGain(0, fadeSamples);
+    }
+
+    static inline void store(int16_t* buf, int w) { *buf = (int16_t)w; }
+    static inline void store(float* buf, int w) { *buf = (float)w * (1.0f / 32768); }
+
+#if defined(SCCVGM_AVX2)
+    // mix of 8 samples: the high bits of |w| * mixScale in the even and odd lanes, with the sign of w (mixScaled)
+    SCCVGM_AVX2 inline __m256i mix8AVX2(const int16_t* psg, const int16_t* scc)
+    {
+        __m256i w = _mm256_add_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)psg)), _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)scc)));
+        const __m256i scale = _mm256_set1_epi32((int)mixScale);
+        __m256i a = _mm256_abs_epi32(w);
+        __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(a, scale), MixScaleBits);
+        __m256i odd = _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), scale), 32 - MixScaleBits);
+        w = _mm256_sign_epi32(_mm256_blend_epi32(even, odd, 0xAA), w);
+        w = _mm256_min_epi32(w, _mm256_set1_epi32(waveMax));
+        return _mm256_max_epi32(w, _mm256_set1_epi32(waveMin));
+    }
+
+    // gain of 8 samples from the head of the block: the level at the sample i is level + step * (i >> shift)
+    SCCVGM_AVX2 static inline __m256i gain8AVX2(__m256i w, int32_t level, __m256i ramp)
+    {
+        __m256i g = _mm256_srai_epi32(_mm256_add_epi32(_mm256_set1_epi32(level), ramp), 15);
+        return _mm256_srai_epi32(_mm256_mullo_epi32(w, g), 15);
+    }
+
+    SCCVGM_AVX2 static inline __m256i rampAVX2(int32_t step, int shift)
+    {
+        __m256i index = _mm256_srl_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm_cvtsi32_si128(shift));
+        return _mm256_mullo_epi32(index, _mm256_set1_epi32(step));
+    }
+
+    SCCVGM_AVX2 int mixAVX2(int16_t* buf, const int16_t* psg, const int16_t* scc, int samples, int32_t level, int32_t step, int shift)
+    {
+        bool unity = GainUnity == level && !step;
+        __m256i ramp = rampAVX2(step, shift);
+        int i = 0;
+        for (; i + 8 <= samples; i += 8) {
+            __m256i w = mix8AVX2(&psg[i], &scc[i]);
+            if (!unity) {
+                w = gain8AVX2(w, level + step * (i >> shift), ramp);
+            }
+            __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+            _mm_storeu_si128((__m128i*)&buf[i], packed);
+        }
+        return i;
+    }
+
+    SCCVGM_AVX2 int mixAVX2(float* buf, const int16_t* psg, const int16_t* scc, int samples, int32_t level, int32_t step, int shift)
+    {
+        const __m256 scale = _mm256_set1_ps(1.0f / 32768);
+        bool unity = GainUnity == level && !step;
+        __m256i ramp = rampAVX2(step, shift);
+        int i = 0;
+        for (; i + 8 <= samples; i += 8) {
+            __m256i w = mix8AVX2(&psg[i], &scc[i]);
+            if (!unity) {
+                w = gain8AVX2(w, level + step * (i >> shift), ramp);
+            }
+            _mm256_storeu_ps(&buf[i], _mm256_mul_ps(_mm256_cvtepi32_ps(w), scale));
+        }
+        return i;
+    }
+#endif
+
+#if !defined(SCCVGM_NO_THREADS)
+    void renderConcurrent(int16_t* buf, int samples)
+    {
+        ChipPass* pass = chipPass;
+        pass->output = buf;
+        pass->start = 0;
+        pass->time = 0;
+        pass->psg.count = 0;
+        pass->scc.count = 0;
+        while (pass->time < samples) {
+            if (vgm.wait < 1) {
+                this->execute(NULL, pass);
+                if (isFadeDue()) {
+                    flushPass(pass->time); // the samples before the loop point are mixed with the current gain
+                    startFade();
+                }
+            }
+            int span = samples - pass->time;
+            if (!vgm.end && vgm.wait < span) {
+                span = vgm.wait < 1 ? 1 : vgm.wait;
+            }
+            vgm.wait -= span;
+            pass->time += span;
+            while (PassSize <= pass->time - pass->start) {
+                flushPass(pass->start + PassSize);
+            }
+        }
+        if (pass->start < samples) {
+            flushPass(samples);
+        }
+    }
+
+    inline void writeChip(ChipLog* log, uint8_t reg, uint8_t value)
+    {
+        if (PassWrites == log->count) {
+            flushPass(chipPass->time);
+        }
+        ChipWrite* w = &log->writes[log->count++];
+        w->time = chipPass->time - chipPass->start;
+        w->reg = reg;
+        w->value = value;
+    }
+
+    // Render the pass until the position (the writes at the position are applied after the pass)
+    void flushPass(int until)
+    {
+        ChipPass* pass = chipPass;
+        pass->length = until - pass->start;
+        uint32_t request = pass->request.load(std::memory_order_relaxed) + 1;
+        pass->request.store(request, std::memory_order_release);
+        renderPass(&emu.scc, &pass->scc, pass->sccBuffer, pass->length);
+        for (int spin = 0; request != pass->done.load(std::memory_order_acquire); spin++) {
+            if (64 < spin) {
+                std::this_thread::yield();
+            }
+        }
+        mix(&pass->output[pass->start], pass->psgBuffer, pass->sccBuffer, pass->length);
+        advanceGain(pass->length);
+        pass->start = until;
+        pass->psg.count = 0;
+        pass->scc.count = 0;
+    }
+
+    template <typename Chip>
+    static void renderPass(Chip* chip, const ChipLog* log, int16_t* buf, int samples)
+    {
+        int time = 0;
+        for (int i = 0; i < log->count; i++) {
+            const ChipWrite* w = &log->writes[i];
+            if (time < w->time) {
+                chip->calcBlock(&buf[time], w->time - time);
+                time = w->time;
+            }
+            chip->writeReg(w->reg, w->value);
+        }
+        if (time < samples) {
+            chip->calcBlock(&buf[time], samples - time);
+        }
+    }
+
+    void chipWorker()
+    {
+        ChipPass* pass = chipPass;
+        uint32_t served = 0;
+        while (true) {
+            // spin for the short interval between the passes, then sleep while idle
+            uint32_t request;
+            for (int spin = 0; served == (request = pass->request.load(std::memory_order_acquire)); spin++) {
+                if (pass->quit.load(std::memory_order_acquire)) {
+                    return;
+                }
+                if (spin < 64) {
+                    continue;
+                } else if (spin < 4096) {
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            }
+            renderPass(&emu.psg, &pass->psg, pass->psgBuffer, pass->length);
+            served = request;
+            pass->done.store(request, std::memory_order_release);
+        }
+    }
+#endif
+
+#if defined(SCCVGM_NO_THREADS)
+    struct ChipPass;
+#endif
+
+    bool execute(RegisterShadow* shadow = NULL, ChipPass* pass = NULL)
+    {
+        if (!events || vgm.end) {
+            return false;
+        }
+        while (vgm.wait < 1) {
+            const VgmEvent* e = &events[vgm.cursor++];
+            switch (e->type) {
+                case VgmSong::EV_PSG:
+                    if (!HasPSG) {
+                        break;
+                    } else if (shadow) {
+                        writeShadowPSG(shadow, e->reg, e->value);
+#if !defined(SCCVGM_NO_THREADS)
+                    } else if (pass) {
+                        writeChip(&pass->psg, e->reg, e->value);
+#endif
+                    } else if (sfxCount) {
+                        writeMixedPSG(-1, e->reg, e->value);
+                    } else {
+                        emu.psg.writeReg(e->reg, e->value);
+                    }
+                    break;
+                case VgmSong::EV_SCC:
+                    if (!HasSCC) {
+                        break;
+                    } else if (shadow) {
+                        writeShadowSCC(shadow, e->reg, e->value);
+#if !defined(SCCVGM_NO_THREADS)
+                    } else if (pass) {
+                        writeChip(&pass->scc, e->reg, e->value);
+#endif
+                    } else if (sfxCount) {
+                        writeMixedSCC(-1, e->reg, e->value);
+                    } else {
+                        emu.scc.writeReg(e->reg, e->value);
+                    }
+                    break;
+                case VgmSong::EV_End:
+                    if (0 <= vgm.loopIndex) {
+                        vgm.loopCount++;
+                        vgm.cursor = vgm.loopIndex;
+                        vgm.currentCycle = vgm.loopCycle;
+                        return false;
+                    }
+                    vgm.end = true;
+                    return false;
+                case VgmSong::EV_Stop:
+                    vgm.end = true;
+                    return false;
+                case VgmSong::EV_Stereo:
+                    if (HasPSG) {
+                        emu.psg.setStereoMask(e->value);
+                    }
+                    break;
+            }
+            addWait(&vgm.wait, &vgm.waitFraction, e->wait);
+            vgm.currentCycle += e->wait;
+        }
+        return true;
+    }
+
+    // the wait is 44100Hz cycles, and the fraction of the output samples is carried to the next wait
+    inline void addWait(int* wait, uint32_t* fraction, uint16_t cycles)
+    {
+        if (44100 == getRate()) {
+            *wait += cycles;
+        } else {
+            uint64_t n = (uint64_t)cycles * getRate() + *fraction;
+            *wait += (int)(n / 44100);
+            *fraction = (uint32_t)(n % 44100);
+        }
+    }
+
+    // Execute the commands that are due, and return the samples until the next command (1 to samples)
+    // (render passes cached, so that it checks the loop cache at the loop point)
+    inline int nextSpan(int samples, bool cached = false)
+    {
+        if (vgm.wait < 1) {
+            if (loopCache.replaying) {
+                this->execute(&loopCache.writes); // the chips resume from the head of the loop (leaveLoopCache)
+            } else {
+                this->execute();
+            }
+            if (isFadeDue()) {
+                startFade();
+            }
+            if (loopCache.loopCount != vgm.loopCount) {
+                loopCache.loopCount = vgm.loopCount;
+                if (cached && loopCache.capacity) {
+                    reachLoop();
+                } else {
+                    loopCache.recording = false;
+                }
+            }
+        }
+        int span = samples;
+        if (!vgm.end && events && vgm.wait < span) {
+            span = vgm.wait < 1 ? 1 : vgm.wait;
+        }
+        if (loopCache.seaming && loopCache.fade - loopCache.position < span) {
+            span = loopCache.fade - loopCache.position; // the replay starts at the end of the crossfade
+        }
+        if (sfxCount) {
+            span = executeSfx(span);
+        }
+        vgm.wait -= span;
+        return span;
+    }
+
+    // Execute the commands of the sound effects that are due, and shorten the span to their next commands
+    int executeSfx(int span)
+    {
+        for (int i = 0; i < MaxSfx; i++) {
+            if (sfx[i].handle && sfx[i].wait < 1 && !runSfx(i, &sfx[i])) {
+                releaseSfx(i);
+            }
+            if (sfx[i].handle && sfx[i].wait < span) {
+                span = sfx[i].wait;
+            }
+        }
+        for (int i = 0; i < MaxSfx; i++) {
+            sfx[i].wait -= sfx[i].handle ? span : 0;
+        }
+        return span;
+    }
+
+    // Execute the commands of the sound effect until its next wait (false: the sound effect is over)
+    bool runSfx(int index, Sfx* s)
+    {
+        const VgmSong* song = s->song;
+        while (s->wait < 1) {
+            const VgmEvent* e = &song->events[s->cursor++];
+            switch (e->type) {
+                case VgmSong::EV_PSG:
+                    if (HasPSG) {
+                        writeMixedPSG(index, e->reg, e->value);
+                    }
+                    break;
+                case VgmSong::EV_SCC:
+                    if (HasSCC) {
+                        writeMixedSCC(index, e->reg, e->value);
+                    }
+                    break;
+                case VgmSong::EV_End:
+                    if (0 <= song->loopIndex && song->loopCycle < song->totalCycle) {
+                        s->cursor = song->loopIndex;
+                        break;
+                    }
+                    return false;
+                case VgmSong::EV_Stop:
+                    return false;
+                case VgmSong::EV_Stereo:
+                    break; // the stereo mask follows the song
+            }
+            addWait(&s->wait, &s->waitFraction, e->wait);
+        }
+        return true;
+    }
+
+    // The sound effect (index) outranks the other one by the priority, then by the age
+    inline bool outranks(int index, int other)
+    {
+        if (sfx[index].priority != sfx[other].priority) {
+            return sfx[other].priority < sfx[index].priority;
+        }
+        return sfx[other].handle < sfx[index].handle;
+    }
+
+    inline RegisterShadow* ownerShadow(int ch) { return owners[ch] < 0 ? &songShadow : &sfx[owners[ch]].shadow; }
+
+    // Whether the writes of the stream (the sound effect index, -1: the song) to the channel reach the chip
+    bool claim(int index, int ch)
+    {
+        if (index < 0) {
+            return owners[ch] < 0;
+        }
+        sfx[index].claims |= 1 << ch;
+        int owner = owners[ch];
+        if (owner == index) {
+            return true;
+        }
+        if (0 <= owner && !outranks(index, owner)) {
+            return false;
+        }
+        owners[ch] = (int8_t)index;
+        if (ch < MC_Noise) {
+            updateMixer();
+        } else if (MC_SCC <= ch) {
+            updateKeys();
+        }
+        return true;
+    }
+
+    // Write a PSG register of the song (index -1) or a sound effect while the sound effects play
+    void writeMixedPSG(int index, uint8_t reg, uint8_t value)
+    {
+        static constexpr int8_t channels[16] = {0, 0, 1, 1, 2, 2, MC_Noise, -1, 0, 1, 2, MC_Envelope, MC_Envelope, MC_Envelope, -1, -1};
+        writeShadowPSG(index < 0 ? &songShadow : &sfx[index].shadow, reg, value);
+        int ch = channels[reg & 15];
+        if (7 == reg) {
+            updateMixer();
+        } else if (ch < 0 ? index < 0 : claim(index, ch)) {
+            emu.psg.writeReg(reg, value); // the I/O ports follow the song
+        }
+    }
+
+    // Write an SCC register of the song (index -1) or a sound effect while the sound effects play
+    void writeMixedSCC(int index, uint8_t reg, uint8_t value)
+    {
+        writeShadowSCC(index < 0 ? &songShadow : &sfx[index].shadow, reg, value);
+        int ch = -1;
+        if (reg < 0xA0) {
+            ch = MC_SCC + (reg >> 5); // channel 3 also writes the waveform of channel 4 in the standard mode
+        } else if (0xC0 <= reg && reg <= 0xC9) {
+            ch = MC_SCC + ((reg & 0x0F) >> 1);
+        } else if (0xD0 <= reg && reg <= 0xD4) {
+            ch = MC_SCC + (reg & 0x0F);
+        }
+        if (0xE1 == reg) {
+            updateKeys();
+        } else if (ch < 0 ? index < 0 : claim(index, ch)) {
+            emu.scc.writeReg(reg, value); // the mode and the test register follow the song
+        }
+    }
+
+    // Compose the PSG mixer (tone and noise enables) of the owners of the channels
+    void updateMixer()
+    {
+        if (!HasPSG) {
+            return;
+        }
+        uint8_t value = songShadow.psg[7] & 0xC0;
+        for (int c = 0; c < 3; c++) {
+            const RegisterShadow* shadow = ownerShadow(MC_PSG + c);
+            shadow = (shadow->psgWritten & (1 << 7)) ? shadow : &songShadow;
+            value |= shadow->psg[7] & (9 << c);
+        }
+        if (value != emu.psg.readReg(7)) {
+            emu.psg.writeReg(7, value);
+        }
+    }
+
+    // Compose the SCC key on/off of the owners of the channels
+    void updateKeys()
+    {
+        if (!HasSCC) {
+            return;
+        }
+        uint8_t value = 0;
+        for (int c = 0; c < 5; c++) {
+            const RegisterShadow* shadow = ownerShadow(MC_SCC + c);
+            shadow = (shadow->sccWritten & ((uint64_t)1 << 0x21)) ? shadow : &songShadow;
+            value |= shadow->scc[0x21] & (1 << c);
+        }
+        if (value != emu.scc.readReg(0xE1)) {
+            emu.scc.writeReg(0xE1, value);
+        }
+    }
+
+    // Write the registers of the channel from its owner (the mixer and the key on/off are composed by the caller)
+    void restoreChannel(int ch)
+    {
+        const RegisterShadow* shadow = ownerShadow(ch);
+        if (ch < MC_SCC) {
+            if (!HasPSG) {
+                return;
+            }
+            static constexpr uint8_t regs[MC_SCC][3] = {{0, 1, 8}, {2, 3, 9}, {4, 5, 10}, {6, 16, 16}, {11, 12, 13}};
+            for (int i = 0; i < 3; i++) {
+                uint8_t reg = regs[ch][i];
+                if (reg < 16 && (shadow->psgWritten & (1 << reg))) {
+                    emu.psg.writeReg(reg, shadow->psg[reg]);
+                }
+            }
+            return;
+        }
+        if (!HasSCC) {
+            return;
+        }
+        int c = ch - MC_SCC;
+        if (c < 4) {
+            // channel 4 shares the waveform of channel 3 in the standard mode
+            for (int i = 0; i < 32; i++) {
+                if (shadow->waveWritten[c] & (1u << i)) {
+                    emu.scc.writeReg(c * 32 + i, (uint8_t)shadow->wave[c][i]);
+                }
+            }
+        }
+        restoreFrequency(shadow, c, (uint8_t)emu.scc.readReg(0xE2));
+        if (shadow->sccWritten & ((uint64_t)1 << (0x10 + c))) {
+            emu.scc.writeReg(0xD0 + c, shadow->scc[0x10 + c]);
+        }
+    }
+
+    // Stop the sound effect, and return its channels to the next owners with their registers
+    void releaseSfx(int index)
+    {
+        sfx[index].handle = 0;
+        sfxCount--;
+        for (int ch = 0; ch < MC_Length; ch++) {
+            if (owners[ch] != index) {
+                continue;
+            }
+            int next = -1;
+            for (int i = 0; i < MaxSfx; i++) {
+                if (sfx[i].handle && (sfx[i].claims & (1 << ch)) && (next < 0 || outranks(i, next))) {
+                    next = i;
+                }
+            }
+            owners[ch] = (int8_t)next;
+            restoreChannel(ch);
+        }
+        updateMixer();
+        updateKeys();
+    }
+
+    // Drop the sound effects without restoring the registers (the chips are reset or restored by the caller)
+    void clearSfx()
+    {
+        for (int i = 0; i < MaxSfx; i++) {
+            sfx[i].handle = 0;
+        }
+        sfxCount = 0;
+        memset(owners, -1, sizeof(owners));
+    }
+
+    // Capture the registers of the chips as the shadow of the song (all registers are written)
+    void captureShadow(RegisterShadow* shadow)
+    {
+        beginShadow(shadow);
+        for (int i = 0; i < 16; i++) {
+            shadow->psg[i] = (uint8_t)emu.psg.readReg(i);
+        }
+        shadow->psgWritten = 0xFFFF;
+        for (int ch = 0; ch < 5; ch++) {
+            for (int i = 0; i < 32; i++) {
+                shadow->wave[ch][i] = (int8_t)emu.scc.readReg(ch * 32 + i);
+            }
+            shadow->waveWritten[ch] = 0xFFFFFFFF;
+        }
+        for (int i = 0; i < 0x40; i++) {
+            shadow->scc[i] = (uint8_t)emu.scc.readReg(0xC0 + i);
+        }
+        shadow->sccWritten = ~(uint64_t)0;
+    }
+
+    // Start to replay the loop cache if the chips are in the state of its head, or record the loop from here
+    // (the loop point before its commands: the playback reaches it with the same wait in every loop)
+    void reachLoop()
+    {
+        LoopCache* c = &loopCache;
+        if (c->replaying) {
+            c->position = 0; // the cached loop ends at the loop point
+            c->waitFraction = vgm.waitFraction;
+            return;
+        }
+        c->seaming = false;
+        if (sfxCount || vgm.end || vgm.cursor != vgm.loopIndex) {
+            c->recording = false;
+            return;
+        }
+        RegisterShadow registers;
+        EMU2149::State psgState;
+        EMU2212::State sccState;
+        captureShadow(&registers);
+        emu.psg.saveState(&psgState);
+        emu.scc.saveState(&sccState);
+        bool steady = 0 < c->length && (c->complete || c->recording) && c->wait == vgm.wait;
+        if (LoopCacheMode::Exact == c->mode) {
+            steady = steady && isSkippable() && c->waitFraction == vgm.waitFraction &&
+                     (!usePSG() || 0 == memcmp(&psgState, &c->psgState, sizeof(EMU2149::State))) &&
+                     (!useSCC() || 0 == memcmp(&sccState, &c->sccState, sizeof(EMU2212::State)));
+        } else {
+            steady = steady && 0 == memcmp(&registers, &c->registers, sizeof(RegisterShadow));
+        }
+        if (steady) {
+            // the fraction of the wait makes the loop a sample longer or shorter than the cache (LoopCacheMode::Lossy)
+            c->waitFraction = vgm.waitFraction;
+            c->complete = true;
+            c->recording = false;
+            c->position = 0;
+            c->seaming = 0 < c->fade;
+            c->replaying = !c->seaming;
+            if (c->length < c->fade) {
+                c->fade = c->length;
+            }
+            return;
+        }
+        if (c->complete) {
+            return; // keep the steady loop (e.g., the loop point after the intro by seek)
+        }
+        memcpy(&c->registers, &registers, sizeof(RegisterShadow));
+        memcpy(&c->psgState, &psgState, sizeof(EMU2149::State));
+        memcpy(&c->sccState, &sccState, sizeof(EMU2212::State));
+        emu.psg.saveContext(&c->psgContext);
+        emu.scc.saveContext(&c->sccContext);
+        c->cursor = vgm.cursor;
+        c->wait = vgm.wait;
+        c->waitFraction = vgm.waitFraction;
+        c->currentCycle = vgm.currentCycle;
+        c->length = 0;
+        c->recording = true;
+    }
+
+    inline void recordLoop(int samples)
+    {
+        LoopCache* c = &loopCache;
+        if (c->capacity - c->length < samples) {
+            c->recording = false; // the loop is longer than the cache
+            c->length = 0;
+            return;
+        }
+        memcpy(&c->psg[c->length], psgBuffer, samples * 2);
+        memcpy(&c->scc[c->length], sccBuffer, samples * 2);
+        c->length += samples;
+    }
+
+    // buf = (tail * (fade - i) + head * i) / fade at the positions i of the seam (from position)
+    inline void crossfadeLoop(int16_t* buf, const int16_t* tail, const int16_t* head, int position, int samples)
+    {
+        int fade = loopCache.fade;
+        for (int i = 0; i < samples; i++) {
+            int w = position + i;
+            buf[i] = (int16_t)((tail[i] * (fade - w) + head[i] * w) / fade);
+        }
+    }
+
+    // Keep the output of the chips after the loop as the tail of the seams, and crossfade it to the head of the cache
+    inline void seamLoop(int samples)
+    {
+        LoopCache* c = &loopCache;
+        memcpy(&c->psgTail[c->position], psgBuffer, samples * 2);
+        memcpy(&c->sccTail[c->position], sccBuffer, samples * 2);
+        crossfadeLoop(psgBuffer, &c->psgTail[c->position], &c->psg[c->position], c->position, samples);
+        crossfadeLoop(sccBuffer, &c->sccTail[c->position], &c->scc[c->position], c->position, samples);
+        c->position += samples;
+        if (c->fade <= c->position) {
+            c->seaming = false;
+            c->replaying = true;
+        }
+    }
+
+    // Mix the span from the loop cache (the commands of the span are executed by nextSpan)
+    void replayLoop(int16_t* buf, int samples)
+    {
+        LoopCache* c = &loopCache;
+        while (0 < samples) {
+            int n = samples;
+            if (c->position < c->fade) {
+                n = c->fade - c->position < n ? c->fade - c->position : n;
+                n = BlockSize < n ? BlockSize : n;
+                crossfadeLoop(psgBuffer, &c->psgTail[c->position], &c->psg[c->position], c->position, n);
+                crossfadeLoop(sccBuffer, &c->sccTail[c->position], &c->scc[c->position], c->position, n);
+                mix(buf, psgBuffer, sccBuffer, n);
+            } else if (c->position < c->length) {
+                n = c->length - c->position < n ? c->length - c->position : n;
+                mix(buf, &c->psg[c->position], &c->scc[c->position], n);
+            } else {
+                // the loop is longer than the cache by the fraction of the wait: hold the last sample
+                n = BlockSize < n ? BlockSize : n;
+                for (int i = 0; i < n; i++) {
+                    psgBuffer[i] = c->psg[c->length - 1];
+                    sccBuffer[i] = c->scc[c->length - 1];
+                }
+                mix(buf, psgBuffer, sccBuffer, n);
+            }
+            advanceGain(n);
+            c->position += n;
+            buf += n;
+            samples -= n;
+        }
+        if (vgm.end) {
+            leaveLoopCache(); // the fade-out is over
+        }
+    }
+
+    // Resume the emulation at the position of the replay (and stop the recording)
+    void leaveLoopCache()
+    {
+        LoopCache* c = &loopCache;
+        c->recording = false;
+        c->seaming = false;
+        if (!c->replaying) {
+            return;
+        }
+        c->replaying = false;
+        // the gain and the fade-out have advanced in the replay
+        Gain g = gain;
+        bool f = fading;
+        int loops = fadeLoops;
+        bool end = vgm.end;
+        fading = false;
+        fadeLoops = 0;
+        emu.psg.loadContext(&c->psgContext);
+        emu.scc.loadContext(&c->sccContext);
+        vgm.cursor = c->cursor;
+        vgm.wait = c->wait;
+        vgm.waitFraction = c->waitFraction;
+        vgm.currentCycle = c->currentCycle;
+        vgm.end = false;
+        skip(c->position);
+        gain = g;
+        fading = f;
+        fadeLoops = loops;
+        vgm.end = end;
+        c->loopCount = vgm.loopCount;
+    }
+
+    // Stop the replay and the recording at a jump of the playback (the steady loop is kept)
+    void stopLoopCache()
+    {
+        loopCache.recording = false;
+        loopCache.seaming = false;
+        loopCache.replaying = false;
+        loopCache.loopCount = vgm.loopCount;
+    }
+
+    // Discard the cached loop (the engines that rendered it are changed)
+    void dropLoopCache()
+    {
+        leaveLoopCache();
+        loopCache.complete = false;
+        loopCache.length = 0;
+    }
+};
+
+typedef BasicVgmDriver<> VgmDriver;
+
+#if !defined(SCCVGM_NO_THREADS)
+/**
+ * Streaming player: a producer thread renders the driver ahead into a lock-free SPSC ring buffer,
+ * and the audio callback only copies the samples out of it with read (no allocation, lock nor syscall).
+ * The driver must not be accessed by the caller between start and stop.
+ */
+template <typename Driver = VgmDriver>
+class BasicVgmPlayer
+{
+  public:
+    struct Status {
+        uint32_t underruns;      // read calls that were not filled entirely (the rest is filled with silence)
+        uint32_t oversizedReads; // read calls that requested more samples than the lead (the lead is too short)
+        int buffered;            // samples rendered ahead at the moment (i.e., the current latency)
+        int minBuffered;         // the lowest buffered samples at the entry of read since start (headroom)
+        int lead;                // samples to render ahead
+    };
+
+  private:
+    enum {
+        ProducerBlock = 256, // samples rendered by the producer at once
+    };
+
+    Driver* driver;
+    int16_t* ring;
+    uint32_t mask;
+    int lead;
+    std::atomic<uint32_t> head; // written by the producer
+    std::atomic<uint32_t> tail; // written by the consumer
+    std::atomic<uint32_t> underruns;
+    std::atomic<uint32_t> oversizedReads;
+    std::atomic<int> minBuffered;
+    std::atomic<bool> running;
+    std::thread producer;
+
+  public:
+    /**
+     * leadSamples is the amount rendered ahead (the latency added by the player).
+     * It should cover the callback size and the worst render spike of the driver.
+     * isReady returns false if the ring buffer could not be allocated.
+     */
+    BasicVgmPlayer(Driver* driver, int leadSamples = 4410)
+    {
+        this->driver = driver;
+        this->ring = NULL;
+        this->mask = 0;
+        this->lead = 0;
+        this->head = 0;
+        this->tail = 0;
+        this->underruns = 0;
+        this->oversizedReads = 0;
+        this->minBuffered = 0;
+        this->running = false;
+        setLead(leadSamples);
+    }
+
+    ~BasicVgmPlayer()
+    {
+        stop();
+        free(ring);
+    }
+
+    /**
+     * Change the lead (stops the producer, and the buffered samples are discarded)
+     * Returns false if out of memory (the player keeps the previous ring buffer and lead).
+     */
+    bool setLead(int leadSamples)
+    {
+        stop();
+        if (leadSamples < ProducerBlock) {
+            leadSamples = ProducerBlock;
+        }
+        uint32_t size = 1;
+        while (size < (uint32_t)leadSamples) {
+            size <<= 1;
+        }
+        head = 0;
+        tail = 0;
+        if (!ring || size - 1 != mask) {
+            int16_t* grown = (int16_t*)malloc(size * 2);
+            if (!grown) {
+                return false;
+            }
+            free(ring);
+            ring = grown;
+            mask = size - 1;
+        }
+        lead = leadSamples;
+        return true;
+    }
+
+    bool isReady() { return NULL != ring; }
+
+    /**
+     * Start the producer: read returns the silence until the first samples are rendered,
+     * so call it a little before the audio device starts if the underrun matters.
+     * Returns false if the ring buffer is not allocated (see isReady).
+     */
+    bool start()
+    {
+        if (running) {
+            return true;
+        }
+        if (!ring) {
+            return false;
+        }
+        head = 0;
+        tail = 0;
+        underruns = 0;
+        oversizedReads = 0;
+        minBuffered = lead;
+        running = true;
+        producer = std::thread([this]() { produce(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if (!running) {
+            return;
+        }
+        running.store(false, std::memory_order_release);
+        producer.join();
+    }
+
+    /**
+     * Audio callback: copy the rendered samples to buf (the shortage is filled with silence).
+     * Returns the number of the rendered samples copied.
+     */
+    int read(int16_t* buf, int samples)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        int buffered = (int)(head.load(std::memory_order_acquire) - t);
+        if (buffered < minBuffered.load(std::memory_order_relaxed)) {
+            minBuffered.store(buffered, std::memory_order_relaxed);
+        }
+        if (lead < samples) {
+            oversizedReads.fetch_add(1, std::memory_order_relaxed);
+        }
+        int n = buffered < samples ? buffered : samples;
+        int index = (int)(t & mask);
+        int first = (int)(mask + 1) - index;
+        if (n < first) {
+            first = n;
+        }
+        if (0 < n) {
+            memcpy(buf, &ring[index], first * 2);
+            memcpy(&buf[first], ring, (n - first) * 2);
+            tail.store(t + n, std::memory_order_release);
+        }
+        if (n < samples) {
+            memset(&buf[n], 0, (samples - n) * 2);
+            underruns.fetch_add(1, std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    Status getStatus()
+    {
+        Status status;
+        status.underruns = underruns.load(std::memory_order_relaxed);
+        status.oversizedReads = oversizedReads.load(std::memory_order_relaxed);
+        status.buffered = (int)(head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire));
+        status.minBuffered = minBuffered.load(std::memory_order_relaxed);
+        status.lead = lead;
+        return status;
+    }
+
+    bool isRunning() { return running; }
+
+  private:
+    void produce()
+    {
+        while (running.load(std::memory_order_acquire)) {
+            uint32_t h = head.load(std::memory_order_relaxed);
+            int space = lead - (int)(h - tail.load(std::memory_order_acquire));
+            if (space < ProducerBlock) {
+                // wait until the consumer reads a block (about 5.8 msec at 44.1kHz)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            // publish each block, so that the consumer can read it as soon as possible
+            int n = ProducerBlock;
+            int index = (int)(h & mask);
+            int first = (int)(mask + 1) - index;
+            if (n < first) {
+                first = n;
+            }
+            driver->render(&ring[index], first);
+            if (first < n) {
+                driver->render(ring, n - first);
+            }
+            head.store(h + n, std::memory_order_release);
+        }
+    }
+};
+
+typedef BasicVgmPlayer<> VgmPlayer;
+#endif
+
 }; // namespace scc